@@ -17,6 +17,7 @@ int main(int argc, char** argv) {
 			"GL",
 			"GLU",
 			"m",
+			"pthread",
 		})
 		.src({
 			"src/external/glew/src/glew.c",
@@ -26,5 +27,29 @@ int main(int argc, char** argv) {
 		.build()
 		.clean();
 
+	// IMR stream replay tool for renderer benchmarking
+	CBuild replay("gcc");
+	replay
+		.out("bin", "replay")
+		.flags({
+			"-D_GNU_SOURCE"
+		})
+		.inc_paths({
+			"./src/",
+		})
+		.libs({
+			"GL",
+			"GLU",
+			"m",
+			"pthread",
+		})
+		.src({
+			"src/external/glew/src/glew.c",
+			"src/external/glfw/src/glfw.c",
+			"src/replay.c",
+		})
+		.build()
+		.clean();
+
 	return 0;
 }
@@ -3,12 +3,20 @@
 
 // :includes
 #include <assert.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "external/glew/include/GL/glew.h"
 #include "external/glfw/include/GLFW/glfw3.h"
 #include "external/stb/stb_image.h"
@@ -230,6 +238,7 @@ m4 m4_translate(m4 m, v3 v);
 m4 m4_transpose(m4 m);
 m4 m4_scale(f32 s);
 m4 ortho_projection(f32 left, f32 right, f32 top, f32 bottom, f32 near, f32 far);
+m4 ortho_screen_mvp(f32 width, f32 height); // Pixel space mvp with origin at top left
 m4 persp_projection(f32 aspect_ratio, f32 fov, f32 near, f32 far);
 m4 rotate_x(f32 theta);
 m4 rotate_y(f32 theta);
@@ -245,6 +254,31 @@ b32 rect_intersect_inclusive(Rect r1, Rect r2);   // Includes comparision with <
 b32 rect_intersect(Rect r1, Rect r2);             // Includes comparision with <
 b32 point_in_rect(v2 p, Rect r);
 Rect rect_with_offset(v2 pos, Rect offset_rect);
+Rect rect_union(Rect r1, Rect r2);
+b32 rect_segment_hit(Rect rect, v2 p0, v2 p1, f32* t); // Where the segment enters, t in [0, 1]
+
+// :rect batch def
+// Rects kept as columns so that one query is tested against a group of them at once,
+// with sse when the target has it and plain c otherwise. The tests give a bit mask,
+// bit i for the rect first + i, so at most 32 rects are tested per call.
+#define RECT_BATCH_LANES 4
+
+typedef struct {
+	f32* x;
+	f32* y;
+	f32* w;
+	f32* h;
+	u32 count;
+	u32 capacity;
+} RectBatch;
+
+RectBatch rect_batch_new(u32 capacity);
+void rect_batch_delete(RectBatch* batch);
+void rect_batch_push(RectBatch* batch, Rect rect);
+Rect rect_batch_get(RectBatch* batch, u32 i);
+u32 rect_batch_overlap(RectBatch* batch, u32 first, u32 count, Rect rect);            // Inclusive like rect_intersect_inclusive
+u32 rect_batch_segment(RectBatch* batch, u32 first, u32 count, v2 p0, v2 p1, f32* t); // Like rect_segment_hit, t per rect
+u32 rect_batch_sweep(RectBatch* batch, u32 first, u32 count, Rect rect, v2 delta, f32* t); // Moving rect, only hits it isnt already in
 
 // :math def
 #define PI 3.14159
@@ -290,6 +324,7 @@ typedef struct {
 	GLFWwindow* glfw_window;
 	u32 width, height;
 	b32 should_close;
+	b32 focused;
 } Window;
 
 Window window_new(const char* title, u32 width, u32 height);
@@ -298,6 +333,9 @@ void window_update(Window* window);
 
 // :frame controller def
 // NOTE: The times are in seconds
+// In idle mode the end of the frame blocks on events for up to idle_timeout
+// instead of running at the frame rate
+#define FRAME_IDLE_TIMEOUT 0.25
 typedef struct {
 	f64 start_time;
 	f64 start_tick;
@@ -305,11 +343,135 @@ typedef struct {
 	f64 dt;
 	i32 frame;
 	i32 fps;
+	b32 idle;
+	f64 idle_timeout;
 } FrameController;
 
 FrameController frame_controller_new(i32 fps);
 void frame_controller_start(FrameController* fc);
 void frame_controller_end(FrameController* fc);
+void frame_controller_set_idle(FrameController* fc, b32 idle);
+
+// :fixed step def
+// Runs the simulation at a fixed rate whatever the frame rate. The frame time is
+// accumulated and spent in whole ticks, what is left over is the interpolation
+// factor between the last two ticks.
+// NOTE: A frame runs at most max_ticks, the rest of a longer stall is dropped so
+// that a slow tick cant snowball
+typedef struct {
+	f64 step;        // Seconds per tick
+	f64 accumulator;
+	u32 max_ticks;
+	u64 ticks;       // Ticks run so far
+	f32 alpha;       // From the previous to the current tick, for rendering
+} FixedStep;
+
+FixedStep fixed_step_new(u32 rate, u32 max_ticks);
+u32 fixed_step_advance(FixedStep* fs, f64 frame_dt); // Ticks to run this frame
+
+// :slot map def
+// Hands out stable handles to items the owner keeps dense in [0, count). A handle is
+// the slot index in the low bits and the generation of the slot in the high bits,
+// destroying bumps the generation so old handles stop resolving.
+// Destroying swap-removes: the last dense item moves into the hole and the owner has
+// to move its own columns the same way (see slot_map_destroy).
+#define SLOT_INDEX_BITS 16
+#define SLOT_INDEX_MASK ((1u << SLOT_INDEX_BITS) - 1)
+#define SLOT_MAX        SLOT_INDEX_MASK
+#define HANDLE_NULL     0 // Generations start at 1 so it never resolves
+#define DENSE_NULL      0xffffffff
+
+typedef u32 Handle;
+
+typedef struct {
+	u32 capacity;
+	u32 count;
+
+	u32* generations; // Per slot
+	u32* dense;       // Per slot, its dense index or the next free slot
+	u32* slots;       // Per dense index, the slot that owns it
+	u32 free_head;
+
+	// Destroyed at the end of the tick so that systems can keep iterating
+	Handle* pending;
+	u32 pending_cnt;
+} SlotMap;
+
+SlotMap slot_map_new(u32 capacity);
+void slot_map_delete(SlotMap* sm);
+Handle slot_map_create(SlotMap* sm);            // Its dense index is count - 1
+u32 slot_map_index(SlotMap* sm, Handle handle); // DENSE_NULL when stale
+Handle slot_map_handle(SlotMap* sm, u32 index);
+u32 slot_map_destroy(SlotMap* sm, Handle handle); // The hole, count is what moved into it
+void slot_map_defer_destroy(SlotMap* sm, Handle handle);
+b32 slot_map_pop_deferred(SlotMap* sm, Handle* handle);
+
+// :spatial grid def
+// Uniform grid over an unbounded world, the cells are hashed into a fixed amount of
+// buckets so only occupied cells cost memory. Items are rects inserted into every
+// cell they cover, it is meant to be cleared and refilled every tick.
+// NOTE: Items are ids in [0, max_items), queries report each one once
+#define GRID_NULL 0xffffffff
+
+typedef struct {
+	u32 item;
+	i32 cx, cy; // Cells of different buckets collide in the hash
+	u32 next;
+} GridEntry;
+
+typedef struct {
+	f32 cell_size;
+	u32 max_items;
+
+	u32* buckets; // First entry of every bucket, power of 2 of them
+	u32 buckets_mask;
+
+	GridEntry* entries;
+	u32 entries_cnt;
+	u32 entries_cap;
+
+	Rect* rects;  // Per item, to test the overlap once the cells match
+	u32* stamps;  // Per item, the query that last reported it
+	u32 stamp;
+} SpatialGrid;
+
+SpatialGrid spatial_grid_new(f32 cell_size, u32 max_items);
+void spatial_grid_delete(SpatialGrid* grid);
+void spatial_grid_clear(SpatialGrid* grid);
+void spatial_grid_insert(SpatialGrid* grid, u32 item, Rect rect);
+u32 spatial_grid_query(SpatialGrid* grid, Rect rect, u32* items, u32 max_items); // Overlapping items, inclusive
+
+// :collision world def
+// Static level rects in a bounding volume hierarchy, so that a query only walks the
+// boxes around it instead of every rect of the level. The tree is built in one go by
+// splitting the rects at the median of the longer axis.
+// NOTE: There is no refitting, the world is built again whenever the level changes
+#define COLLISION_LEAF_RECTS (2 * RECT_BATCH_LANES)
+#define COLLISION_MAX_DEPTH  64
+
+typedef struct {
+	Rect bounds;
+	u32 first; // Leaves: first rect, inner nodes: left child, the right one follows it
+	u32 count; // Rects in a leaf, 0 for inner nodes
+} CollisionNode;
+
+typedef struct {
+	RectBatch rects; // Reordered so that every leaf is a run, its rects are tested together
+	Rect* sorted;    // Scratch of the build
+	u32 sorted_cap;
+
+	CollisionNode* nodes;
+	u32 nodes_cnt, nodes_cap;
+
+	Rect* found;  // Query results
+	u32 found_cap;
+} CollisionWorld;
+
+CollisionWorld collision_world_new();
+void collision_world_delete(CollisionWorld* world);
+void collision_world_build(CollisionWorld* world, Rect* rects, u32 rects_cnt);
+Rect* collision_world_query(CollisionWorld* world, Rect area, u32* found_cnt); // Overlapping the area, inclusive
+b32 collision_world_sweep(CollisionWorld* world, Rect rect, v2 delta, f32* toi); // Earliest time of impact of a moving rect
 
 // :event def
 typedef enum {
@@ -371,6 +533,7 @@ void ocamera_change_zoom(OCamera* cam, f32 dz);
 void ocamera_change_pos(OCamera* cam, v2 dp);
 void ocamera_follow(OCamera* cam, Rect to_follow_rect, v2 offset, f32 delay, v2 surf_size);
 m4 ocamera_calc_mvp(OCamera* cam);
+Rect ocamera_view_rect(OCamera* cam); // World area seen by the camera, assumes a zoom of 1
 
 // :pcamera def
 typedef struct {
@@ -402,15 +565,91 @@ typedef struct {
 	u32 id, width, height;
 } Texture;
 
-// TODO: Implement control over texture filters
-// Filters are hard coded for now
+typedef struct {
+	u32 min_filter, mag_filter; // Mip filters for min_filter need mipmaps
+	u32 wrap_s, wrap_t;
+	b32 mipmaps;
+	b32 compress;               // S3TC for color and RGTC for single channel, if the driver has them
+} TextureOptions;
+
+#define TEXTURE_OPTIONS_DEFAULT ((TextureOptions) { GL_NEAREST, GL_NEAREST, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, false, false })
+#define TEXTURE_OPTIONS_LINEAR  ((TextureOptions) { GL_LINEAR,  GL_LINEAR,  GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, false, false })
+
+// The _ex variants take options, the others use TEXTURE_OPTIONS_DEFAULT
 Texture texture_from_file(const char* filepath, b32 flip);
+Texture texture_from_file_ex(const char* filepath, b32 flip, TextureOptions opts);
 Texture texture_from_data(u32 width, u32 height, u32* data);
+Texture texture_from_data_ex(u32 width, u32 height, u32* data, TextureOptions opts);
+// format is the layout of data (GL_RED, GL_RGB or GL_RGBA with a byte per channel), data can be NULL
+Texture texture_new_ex(u32 width, u32 height, u32 format, const void* data, TextureOptions opts);
 void texture_clear(Texture texture);
-void texture_bind(Texture texture);
+void texture_bind(Texture texture);   // Binds to the scratch unit, for uploads and parameter changes
 void texture_unbind(Texture texture);
 void texture_delete(Texture texture);
 
+// :texture registry def
+// Keeps an estimate of the video memory used by every live texture
+#define MAX_TRACKED_TEXTURES 1024
+typedef struct {
+	u32 id;
+	u64 bytes;
+} TextureEntry;
+
+typedef struct {
+	TextureEntry entries[MAX_TRACKED_TEXTURES];
+	u32 entries_cnt;
+	u64 used;
+	u64 budget; // 0 means no budget
+	b32 over_budget;
+} TextureRegistry;
+
+u64 texture_estimate_bytes(u32 width, u32 height, u32 internal_format, b32 mipmaps);
+void texture_registry_add(u32 id, u64 bytes);
+void texture_registry_remove(u32 id);
+void texture_set_vram_budget(u64 bytes); // Warns whenever the live textures go over it
+u64 texture_vram_used();
+
+// :texture slots def
+// Sampler units are shared by every imr, so what is resident in them is kept on the context.
+// Slot 0 is pinned to the white texture, which every imr shares and which is bound once
+// by the first imr, and PALETTE_UNIT to the palette,
+// the rest are handed out to batches in lru order (see imr_texture_slot).
+// Uploads and readbacks go through the scratch unit which is never sampled.
+#define TEXTURE_SAMPLE_AMT   32
+#define TEXTURE_SCRATCH_UNIT TEXTURE_SAMPLE_AMT
+typedef struct {
+	u32 textures[TEXTURE_SAMPLE_AMT]; // 0 is an empty slot
+	u64 stamps[TEXTURE_SAMPLE_AMT];
+	u64 clock;
+	Texture white;
+	u32 white_refs; // Imrs using it, the last one deletes it
+} TextureSlots;
+
+// :palette def
+// Indexed sheets store a palette index per pixel in an R8 texture and the imr shader
+// resolves the color through a palette row. Every row is the source colors multiplied
+// by a tint, so a new look for a sheet costs one row instead of another sheet.
+// The palette is bound to the last sampler unit, textures must not be bound there.
+#define PALETTE_COLORS   256
+#define PALETTE_MAX_ROWS 64
+#define PALETTE_UNIT     (TEXTURE_SAMPLE_AMT - 1)
+#define PALETTE_NONE     -1.0f
+
+typedef struct {
+	Texture texture; // PALETTE_COLORS x PALETTE_MAX_ROWS RGBA8
+	u32 colors[PALETTE_COLORS];
+	u32 colors_cnt;
+	v4 tints[PALETTE_MAX_ROWS];
+	u32 rows_cnt;
+} Palette;
+
+Palette palette_new();
+void palette_delete(Palette* palette);
+u32 palette_add_row(Palette* palette, v4 tint); // Row 0 is always the untinted source colors
+void palette_upload(Palette* palette);
+// Adds the colors of the sheet to the palette, panics if it runs out of colors
+Texture texture_from_file_indexed(const char* filepath, b32 flip, Palette* palette);
+
 // :shader def
 typedef u32 Shader;
 typedef enum {
@@ -429,9 +668,23 @@ typedef struct {
 } FBO;
 
 FBO fbo_new(u32 width, u32 height);
+FBO fbo_new_ex(u32 width, u32 height, TextureOptions opts);
 void fbo_delete(FBO* fbo);
+// Binding pushes the fbo onto the context's target stack and sets the viewport to its size
+// Unbinding pops it and restores the previous target (the window at the bottom)
+// Clearing is left to the caller
+#define MAX_RENDER_TARGETS 8
+typedef struct {
+	u32 id, texture, width, height;
+} RenderTarget;
+
 void fbo_bind(FBO* fbo);
+void fbo_bind_region(FBO* fbo, u32 width, u32 height); // Only renders into the bottom left width x height
 void fbo_unbind();
+void fbo_apply_target(RenderTarget target);
+RenderTarget fbo_current_target();
+void fbo_copy_from_target(FBO* fbo); // Copies the current target into the fbo
+void fbo_copy_to_target(FBO* fbo);   // Copies the fbo over the current target
 
 // :imr def
 typedef struct {
@@ -440,50 +693,420 @@ typedef struct {
 	v2 tex_coord;
 	f32 tex_id;
 	v4 overlay_color;
+	f32 palette; // Palette row, PALETTE_NONE for regular textures
 } Vertex;
 
 typedef struct {
 	v3 a, b, c;
 } Triangle;
 
-#define TEXTURE_SAMPLE_AMT 32
-#define VERTEX_SIZE   14
-#define MAX_VERT_CNT  10000
-#define MAX_BUFF_CAP  MAX_VERT_CNT  * VERTEX_SIZE
-#define MAX_VBO_SIZE  MAX_BUFF_CAP  * sizeof(f32)
+#define VERTEX_SIZE   15
 
 STATIC_ASSERT(VERTEX_SIZE == sizeof(Vertex) / sizeof(f32), "Size of vertex missmatched");
 
+// A view draws the recorded batch again with its own mvp into a part of the target
+// The viewport is normalized to the current target with the origin at the bottom left
+#define MAX_IMR_VIEWS 4
+typedef struct {
+	m4 mvp;
+	Rect viewport;
+} IMR_View;
+
+// The vertex buffer starts at init_verts and doubles up to max_verts,
+// so it settles at the high water mark of the frame. Batches only flush
+// early once they go over max_verts.
+typedef struct {
+	u32 init_verts;
+	u32 max_verts;
+} IMR_Config;
+
+#define IMR_CONFIG_DEFAULT ((IMR_Config) { 4096, 1 << 20 })
+
 typedef struct {
 	u32 vao, vbo;
 	Shader shader;
 	Shader def_shader;
-	f32 buffer[MAX_BUFF_CAP];
+	f32* buffer;
 	u32 buff_idx;
+	u32 buff_cap; // In floats
+	u32 max_cap;
+	u32 vbo_cap;
 	Texture white;
+	u32 slots_used; // Mask of the slots referenced by the current batch
+	m4 mvp;
+	IMR_View views[MAX_IMR_VIEWS];
+	u32 views_cnt;
 } IMR;
 
-IMR imr_new();
+IMR imr_new(IMR_Config config);
 void imr_delete(IMR* imr);
+void imr_reserve(IMR* imr, u32 verts); // Makes room for more vertices, flushes at the max size
 void imr_clear(v4 color);
+void imr_blend(u32 src, u32 dst);
+void imr_blend_separate(u32 src, u32 dst, u32 src_alpha, u32 dst_alpha);
 void imr_begin(IMR* imr);
 void imr_end(IMR* imr);
 void imr_switch_shader(IMR* imr, Shader shader);
 void imr_reapply_samplers(IMR* imr);
 void imr_switch_shader_to_default(IMR* imr);
 void imr_update_mvp(IMR* imr, m4 mvp);
+void imr_set_views(IMR* imr, IMR_View* views, u32 views_cnt); // 0 views draws once with the imr mvp
+void imr_draw_arrays(IMR* imr, u32 vao, u32 verts);              // Draws a vao in the imr format through every view
+void imr_set_palette(IMR* imr, Palette* palette);
+// Makes the texture resident and returns the slot to write into tex_id,
+// flushes the batch only when every slot is already taken by it
+u32 imr_texture_slot(IMR* imr, u32 texture_id);
+void imr_bind_slot(u32 slot, u32 texture_id);
 void imr_push_vertex(IMR* imr, Vertex v);
 void imr_push_quad(IMR* imr, v3 pos, v2 size, m4 rot, v4 color);
 void imr_push_quad_overlay(IMR* imr, v3 pos, v2 size, m4 rot, v4 color, v4 overlay_color);
+// tex_id is the gl id of the texture, the push translates it into a slot
 void imr_push_quad_tex(IMR* imr, v3 pos, v2 size, Rect tex_rect, f32 tex_id, m4 rot, v4 color);
 void imr_push_quad_tex_overlay(IMR* imr, v3 pos, v2 size, Rect tex_rect, f32 tex_id, m4 rot, v4 color, v4 overlay_color);
+void imr_push_quad_tex_palette(IMR* imr, v3 pos, v2 size, Rect tex_rect, f32 tex_id, f32 palette_row, m4 rot, v4 color, v4 overlay_color);
 void imr_push_triangle(IMR* imr, v3 p1, v3 p2, v3 p3, m4 rot, v4 color);
 void imr_push_triangle_tex(IMR* imr, v3 p1, v3 p2, v3 p3, Triangle tex_coord, f32 tex_id, m4 rot, v4 color);
 
+// :imr capture def
+// Binary file layout:
+//   header: IMR_Capture_Header
+//   records: { u32 type, u32 size, u8 payload[size] } until EOF
+#define IMR_CAPTURE_MAGIC   0x43524d49 // "IMRC"
+#define IMR_CAPTURE_VERSION 3
+
+typedef enum {
+	IMR_CMD_FRAME,    // No payload, marks the end of a frame
+	IMR_CMD_CLEAR,    // v4 color
+	IMR_CMD_SHADER,   // u32 shader, u32 is_default
+	IMR_CMD_MVP,      // m4 mvp (row major)
+	IMR_CMD_DRAW,     // f32 vertices[size / sizeof(f32)]
+	IMR_CMD_TEXTURE,  // u32 id, u32 width, u32 height, u32 pixels[width * height] (RGBA8)
+	IMR_CMD_BLEND,    // u32 src, u32 dst, optionally followed by u32 src_alpha, u32 dst_alpha
+	IMR_CMD_TARGET,   // u32 fbo, u32 texture, u32 width, u32 height (fbo 0 is the window)
+	IMR_CMD_VIEWS,    // u32 views_cnt, IMR_View views[views_cnt]
+	IMR_CMD_BIND,     // u32 slot, u32 texture
+} IMR_CmdType;
+
+typedef struct {
+	u32 magic;
+	u32 version;
+	u32 width, height;
+} IMR_Capture_Header;
+
+typedef struct {
+	u32 type;
+	u32 size;
+} IMR_Capture_Record;
+
+typedef struct {
+	FILE* file;
+	u32 frames;
+} IMR_Capture;
+
+// Starts recording every IMR command into the file until deleted
+IMR_Capture* imr_capture_new(const char* filepath, u32 width, u32 height);
+void imr_capture_delete(IMR_Capture* cap);
+void imr_capture_write(IMR_Capture* cap, IMR_CmdType type, const void* data, u32 size);
+void imr_capture_texture(IMR_Capture* cap, Texture texture);
+void imr_capture_frame(IMR_Capture* cap);
+
+// :overdraw def
+// Debug mode that counts how many fragments land on each pixel
+typedef struct {
+	FBO fbo;
+	Shader count_shader;
+	Shader heat_shader;
+	u8* counts;
+	f32 avg;
+	u32 max;
+} Overdraw;
+
+Overdraw overdraw_new(u32 width, u32 height);
+void overdraw_delete(Overdraw* od);
+void overdraw_begin(Overdraw* od, IMR* imr);   // Redirects the imr output into the counting fbo
+void overdraw_end(Overdraw* od, IMR* imr);     // Restores the imr output and computes avg and max
+void overdraw_present(Overdraw* od, IMR* imr); // Draws the counts as a heatmap over the whole target
+
+// :lighting def
+// Lights are accumulated into a low resolution light buffer which is then
+// upsampled with bilinear filtering and multiplied over the scene in one pass.
+// The buffer stores half of the light so the composite can brighten up to 2x.
+#define LIGHT_DOWNSCALE 4
+#define LIGHT_FALLOFF_SIZE 64
+
+typedef struct {
+	FBO fbo;
+	Texture falloff;
+	v4 ambient;
+} Lighting;
+
+Lighting lighting_new(u32 width, u32 height, v4 ambient);
+void lighting_delete(Lighting* lighting);
+void lighting_begin(Lighting* lighting, IMR* imr);
+void lighting_push(Lighting* lighting, IMR* imr, v2 pos, f32 radius, v4 color);
+void lighting_end(Lighting* lighting, IMR* imr);
+void lighting_composite(Lighting* lighting, IMR* imr);
+
+// :render scale def
+// Renders into a region of a full size fbo whose size follows the gpu frame time.
+// Timer queries are kept in a ring so reading them back never stalls.
+// The scale only drops after RENDER_SCALE_DOWN_FRAMES frames over the target
+// and only rises after RENDER_SCALE_UP_FRAMES frames under target * RENDER_SCALE_HEADROOM.
+// Queries issued before the last scale change are dropped, they timed the old size.
+#define RENDER_SCALE_QUERIES 4
+#define RENDER_SCALE_MIN 0.5f
+#define RENDER_SCALE_STEP 0.1f
+#define RENDER_SCALE_HEADROOM 0.7f
+#define RENDER_SCALE_DOWN_FRAMES 5
+#define RENDER_SCALE_UP_FRAMES 60
+
+typedef struct {
+	FBO fbo;
+	f32 scale;
+	f64 target_ms;
+	f64 gpu_ms;
+
+	u32 queries[RENDER_SCALE_QUERIES];
+	b32 pending[RENDER_SCALE_QUERIES];
+	u32 epochs[RENDER_SCALE_QUERIES]; // Value of epoch when issued
+	u32 epoch;                        // Bumped on every scale change
+	u32 query_idx;
+	b32 querying;
+
+	i32 over_frames;
+	i32 under_frames;
+} RenderScale;
+
+RenderScale render_scale_new(u32 width, u32 height, f64 target_ms);
+void render_scale_delete(RenderScale* rs);
+void render_scale_begin(RenderScale* rs);               // Starts the frame timing and binds the scaled target
+void render_scale_end();                                // Unbinds the scaled target
+void render_scale_present(RenderScale* rs, IMR* imr);   // Upscales the scaled target over the current target
+void render_scale_update(RenderScale* rs);              // Ends the frame timing and adapts the scale
+
+// :ui layer def
+// Widgets are drawn into a cached target that is only redrawn when one of the inputs
+// declared for the frame changed, otherwise the cache is composited with a single quad.
+// Inputs should be quantised to what ends up on screen (eg. the pixel length of a bar).
+// Widgets are drawn in screen pixels and the cache only holds the rect of the layer,
+// so it should be kept to the bounds of its widgets.
+#define UI_MAX_INPUTS 64
+typedef struct {
+	FBO fbo;
+	Rect rect;     // Part of the screen the cache covers, in pixels
+	v2 screen;
+	m4 prev_mvp;   // Restored once redrawn
+	i32 inputs[UI_MAX_INPUTS];
+	u32 inputs_cnt;
+	u32 prev_inputs_cnt;
+	b32 dirty;
+} UILayer;
+
+UILayer ui_layer_new(Rect rect, v2 screen);
+void ui_layer_delete(UILayer* ui);
+void ui_layer_begin(UILayer* ui);                  // Starts declaring the inputs of the frame
+void ui_layer_input(UILayer* ui, i32 value);
+void ui_layer_invalidate(UILayer* ui);
+b32 ui_layer_redraw_begin(UILayer* ui, IMR* imr);  // Returns true and binds the cache when it has to be redrawn
+void ui_layer_redraw_end(UILayer* ui, IMR* imr);
+void ui_layer_present(UILayer* ui, IMR* imr);      // Composites the cache over the current target
+
+// :parallax def
+// Every layer is composed into a texture that wraps horizontally once, and again only
+// when invalidated. Drawing is one quad per layer scrolled sideways through its uvs, so
+// the cost doesnt depend on what the layer holds. Layers dont scroll vertically, they
+// cover the view as composed and a view taller than a layer stretches its edge row.
+// Layers are drawn with the regular alpha blending, so their content should be opaque
+// where it isnt fully transparent.
+#define MAX_PARALLAX_LAYERS 8
+typedef void (*ParallaxComposeFn)(IMR* imr, u32 width, u32 height, void* data);
+
+typedef struct {
+	FBO fbo;
+	f32 factor;  // How much the layer follows the camera, 0 is fixed and 1 moves with the world
+	ParallaxComposeFn compose;
+	void* data;
+	b32 dirty;
+} ParallaxLayer;
+
+typedef struct {
+	ParallaxLayer layers[MAX_PARALLAX_LAYERS];
+	u32 layers_cnt;
+} Parallax;
+
+Parallax parallax_new();
+void parallax_delete(Parallax* p);
+u32 parallax_add_layer(Parallax* p, u32 width, u32 height, f32 factor, ParallaxComposeFn compose, void* data); // Added back to front
+void parallax_invalidate(Parallax* p, u32 layer);
+void parallax_update(Parallax* p, IMR* imr);                      // Composes the dirty layers
+void parallax_draw(Parallax* p, IMR* imr, v2 cam_pos, v2 view_size); // Covers the current target or view
+
+// :tilemap def
+// Tiles are stored in square chunks that each own a static mesh, built on the first
+// draw after one of their tiles changed. Only the chunks overlapping the view are
+// drawn. Tiles are flat colored quads through the white texture.
+// Chunks are only allocated once resident, a chunk that isnt reads as empty.
+// NOTE: The collision rects are merged from the same tiles, so the map is the only
+// source of level geometry
+#define TILEMAP_CHUNK_SIZE  16 // Tiles per chunk side
+#define TILEMAP_CHUNK_TILES (TILEMAP_CHUNK_SIZE * TILEMAP_CHUNK_SIZE)
+#define TILEMAP_CHUNK_RECTS (TILEMAP_CHUNK_TILES / 2) // Enough for a checkerboard
+#define TILEMAP_MAX_KINDS   16
+#define TILE_EMPTY          0
+
+typedef u8 Tile;
+
+typedef struct {
+	Tile tiles[TILEMAP_CHUNK_TILES];
+	Rect rects[TILEMAP_CHUNK_RECTS]; // Merged within the chunk
+	u32 rects_cnt;
+	b32 rects_dirty;
+
+	u32 vao, vbo;
+	f32* mesh;   // Kept on the cpu for captures
+	u32 verts;
+	u32 vbo_cap; // In vertices
+	b32 dirty;
+} TileChunk;
+
+typedef struct {
+	u32 width, height;          // In tiles
+	u32 chunks_w, chunks_h;
+	f32 tile_size;              // In pixels
+	TileChunk** chunks;         // NULL when not resident
+	v4 colors[TILEMAP_MAX_KINDS];
+
+	Rect* rects;
+	u32 rects_cnt, rects_cap;
+	b32 rects_dirty;
+} Tilemap;
+
+Tilemap tilemap_new(u32 width, u32 height, f32 tile_size);
+void tilemap_delete(Tilemap* map);
+void tilemap_set_color(Tilemap* map, Tile tile, v4 color);
+Tile tilemap_get(Tilemap* map, i32 x, i32 y);                          // Empty out of bounds
+void tilemap_set(Tilemap* map, i32 x, i32 y, Tile tile);               // Only the owning chunk is rebuilt
+void tilemap_fill(Tilemap* map, i32 x, i32 y, i32 w, i32 h, Tile tile);
+b32 tilemap_pick(Tilemap* map, v2 world_pos, i32* x, i32* y);          // Tile under a world position
+TileChunk* tilemap_chunk_load(Tilemap* map, u32 cx, u32 cy);           // Makes a chunk resident, empty when new
+void tilemap_chunk_unload(Tilemap* map, u32 cx, u32 cy);
+u32 tilemap_merge_rects(Tilemap* map, TileChunk* chunk, u32 cx, u32 cy, Rect* rects);
+Rect* tilemap_rects(Tilemap* map, i32* rects_cnt);                     // Resident solid tiles, rebuilt after edits
+void tilemap_draw(Tilemap* map, IMR* imr, Rect view);                  // Outside of imr_begin and imr_end
+
+// :level def
+// On disk a level is a header, an index with an entry per chunk and then the data
+// of every non empty chunk. The file is mapped and the chunks around the view are
+// paged in and out of a tilemap, so only those are in memory whatever the size of
+// the level. Every view gets its own window, split views far apart dont keep the
+// chunks between them. A thread prefetches the pages of the ring of chunks past the window, so
+// that walking into them doesnt stall on the disk.
+// Spawns are all read at open so that the game can place everything upfront, only
+// the resident chunks have collision though and it is up to the game to hold whatever
+// isnt over them (see level_stream_covers).
+// NOTE: Edits to a streamed chunk are lost once it pages out
+#define LEVEL_MAGIC          0x4c56454c // "LEVL"
+#define LEVEL_VERSION        1
+#define LEVEL_STREAM_VIEWS   2
+
+typedef struct {
+	u32 magic;
+	u32 version;
+	u32 width, height;     // In tiles
+	u32 chunks_w, chunks_h;
+	u32 chunk_size;        // Has to match TILEMAP_CHUNK_SIZE
+	f32 tile_size;
+} LevelHeader;
+
+// Chunk data is Tile[TILEMAP_CHUNK_TILES], Rect[rects_cnt] and LevelSpawn[spawns_cnt]
+typedef struct {
+	u64 offset;            // From the start of the file, 0 for an empty chunk
+	u32 rects_cnt;
+	u32 spawns_cnt;
+} LevelChunkEntry;
+
+typedef struct {
+	u32 kind;              // Defined by the game
+	v2 pos;
+} LevelSpawn;
+
+typedef struct {
+	i32 x0, y0, x1, y1;    // In chunks, inclusive
+} LevelWindow;
+
+typedef struct {
+	Tilemap* map;
+	i32 fd;
+	u8* data;
+	size_t size;
+	LevelHeader* header;
+	LevelChunkEntry* index;
+
+	u32 radius;            // Chunks kept resident past the view
+	LevelWindow windows[LEVEL_STREAM_VIEWS];
+	u32 windows_cnt;
+	LevelSpawn* spawns;    // Every spawn of the level
+	u32 spawns_cnt;
+	u32 spawns_polled;
+
+	// Prefetch thread
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	LevelWindow prefetch[LEVEL_STREAM_VIEWS];
+	u32 prefetch_cnt;
+	b32 prefetch_pending;
+	b32 running;
+} LevelStream;
+
+b32 level_save(Tilemap* map, LevelSpawn* spawns, u32 spawns_cnt, const char* path); // The map has to be fully resident
+LevelStream* level_stream_open(const char* path, Tilemap* map, u32 radius);         // Creates the map from the level
+void level_stream_close(LevelStream* stream);
+void level_stream_update(LevelStream* stream, Rect* views, u32 views_cnt);         // Up to LEVEL_STREAM_VIEWS
+b32 level_stream_covers(LevelStream* stream, Rect area);                             // Every chunk under the area is resident, past the level counts
+b32 level_stream_poll_spawn(LevelStream* stream, LevelSpawn* spawn);
+
+// :debug draw def
+// Debug geometry is recorded into its own transient imr and drawn with one call at the
+// end of the frame, so it never changes the batching of the frame being inspected.
+// Categories are a user defined bitmask that can be toggled at runtime, call sites go
+// through the debug_* macros which only test the mask when the category is off.
+#define DEBUG_FONT_W 3
+#define DEBUG_FONT_H 5
+#define DEBUG_TEXT_CAP 256
+
+typedef struct {
+	IMR imr;
+	u32 enabled; // Mask of the enabled categories
+} DebugDraw;
+
+DebugDraw debug_draw_new();
+void debug_draw_delete(DebugDraw* dd);
+void debug_draw_begin(DebugDraw* dd);
+// Draws everything recorded since begin, views are the same as imr_set_views
+void debug_draw_flush(DebugDraw* dd, m4 mvp, IMR_View* views, u32 views_cnt);
+void debug_draw_line(DebugDraw* dd, v2 a, v2 b, f32 thickness, v4 color);
+void debug_draw_rect(DebugDraw* dd, Rect rect, v4 color);         // Filled
+void debug_draw_rect_lines(DebugDraw* dd, Rect rect, v4 color);   // Outline
+void debug_draw_text(DebugDraw* dd, v2 pos, f32 scale, v4 color, const char* fmt, ...); // scale is the size of a font pixel
+
+#define debug_on(cat) __builtin_expect(ctx->debug && (ctx->debug->enabled & (cat)), 0)
+#define debug_line(cat, ...)       do { if (debug_on(cat)) debug_draw_line(ctx->debug, __VA_ARGS__); } while (0)
+#define debug_rect(cat, ...)       do { if (debug_on(cat)) debug_draw_rect(ctx->debug, __VA_ARGS__); } while (0)
+#define debug_rect_lines(cat, ...) do { if (debug_on(cat)) debug_draw_rect_lines(ctx->debug, __VA_ARGS__); } while (0)
+#define debug_text(cat, ...)       do { if (debug_on(cat)) debug_draw_text(ctx->debug, __VA_ARGS__); } while (0)
+
 // :context def
 typedef struct {
 	Trace_Allocator* t_alloc;
 	EventQueue e_queue;
+	IMR_Capture* capture;
+	TextureRegistry textures;
+	TextureSlots slots;
+	u32 win_width, win_height;
+	RenderTarget targets[MAX_RENDER_TARGETS];
+	u32 targets_cnt;
+	DebugDraw* debug;
 	void* inner;
 } Context;
 
@@ -504,6 +1127,13 @@ void ctx_begin() {
 		.front = 0,
 		.back  = 0,
 	};
+	ctx->capture = NULL;
+	ctx->textures = (TextureRegistry) {0};
+	ctx->slots = (TextureSlots) {0};
+	ctx->win_width = 0;
+	ctx->win_height = 0;
+	ctx->targets_cnt = 0;
+	ctx->debug = NULL;
 	ctx->inner = NULL;
 }
 
@@ -1011,6 +1641,10 @@ m4 ortho_projection(f32 left, f32 right, f32 top, f32 bottom, f32 near, f32 far)
 	};
 }
 
+m4 ortho_screen_mvp(f32 width, f32 height) {
+	return m4_transpose(ortho_projection(0, width, 0, height, -1.0f, 1.0f));
+}
+
 m4 persp_projection(f32 aspect_ratio, f32 fov, f32 near, f32 far) {
 	f32 t = tanf(to_radians(fov / 2));
 	f32 z_range = near - far;
@@ -1100,6 +1734,226 @@ Rect rect_with_offset(v2 pos, Rect offset_rect) {
 	};
 }
 
+Rect rect_union(Rect r1, Rect r2) {
+	f32 x = fminf(r1.x, r2.x);
+	f32 y = fminf(r1.y, r2.y);
+	return (Rect) {
+		x, y,
+		fmaxf(r1.x + r1.w, r2.x + r2.w) - x,
+		fmaxf(r1.y + r1.h, r2.y + r2.h) - y
+	};
+}
+
+b32 rect_segment_hit(Rect rect, v2 p0, v2 p1, f32* t) {
+	f32 tmin = 0.0f;
+	f32 tmax = 1.0f;
+	v2 d = { p1.x - p0.x, p1.y - p0.y };
+
+	// Clipping the segment against the slab of each axis
+	for (i32 i = 0; i < 2; i++) {
+		f32 origin = i == 0 ? p0.x : p0.y;
+		f32 dir    = i == 0 ? d.x : d.y;
+		f32 min    = i == 0 ? rect.x : rect.y;
+		f32 max    = i == 0 ? rect.x + rect.w : rect.y + rect.h;
+
+		if (dir == 0.0f) {
+			if (origin < min || origin > max) return false;
+		} else {
+			f32 t1 = (min - origin) / dir;
+			f32 t2 = (max - origin) / dir;
+			if (t1 > t2) {
+				f32 tmp = t1; t1 = t2; t2 = tmp;
+			}
+
+			if (t1 > tmin) tmin = t1;
+			if (t2 < tmax) tmax = t2;
+			if (tmin > tmax) return false;
+		}
+	}
+
+	if (t) *t = tmin;
+	return true;
+}
+
+// :rect batch impl
+RectBatch rect_batch_new(u32 capacity) {
+	RectBatch batch = {0};
+	capacity = (capacity + RECT_BATCH_LANES - 1) / RECT_BATCH_LANES * RECT_BATCH_LANES;
+	if (!capacity) capacity = RECT_BATCH_LANES;
+
+	batch.capacity = capacity;
+	batch.x = mem_alloc(capacity * sizeof(f32));
+	batch.y = mem_alloc(capacity * sizeof(f32));
+	batch.w = mem_alloc(capacity * sizeof(f32));
+	batch.h = mem_alloc(capacity * sizeof(f32));
+	return batch;
+}
+
+void rect_batch_delete(RectBatch* batch) {
+	mem_free(batch->x);
+	mem_free(batch->y);
+	mem_free(batch->w);
+	mem_free(batch->h);
+}
+
+void rect_batch_push(RectBatch* batch, Rect rect) {
+	if (batch->count == batch->capacity) {
+		batch->capacity *= 2;
+		batch->x = mem_realloc(batch->x, batch->capacity * sizeof(f32));
+		batch->y = mem_realloc(batch->y, batch->capacity * sizeof(f32));
+		batch->w = mem_realloc(batch->w, batch->capacity * sizeof(f32));
+		batch->h = mem_realloc(batch->h, batch->capacity * sizeof(f32));
+	}
+
+	u32 i = batch->count++;
+	batch->x[i] = rect.x;
+	batch->y[i] = rect.y;
+	batch->w[i] = rect.w;
+	batch->h[i] = rect.h;
+}
+
+Rect rect_batch_get(RectBatch* batch, u32 i) {
+	return (Rect) { batch->x[i], batch->y[i], batch->w[i], batch->h[i] };
+}
+
+u32 rect_batch_overlap(RectBatch* batch, u32 first, u32 count, Rect rect) {
+	panic(count <= 32, "Too many rects for a batch mask: %d\n", count);
+
+	u32 mask = 0;
+	u32 i = 0;
+#ifdef __SSE2__
+	__m128 qx0 = _mm_set1_ps(rect.x);
+	__m128 qy0 = _mm_set1_ps(rect.y);
+	__m128 qx1 = _mm_set1_ps(rect.x + rect.w);
+	__m128 qy1 = _mm_set1_ps(rect.y + rect.h);
+
+	for (; i + RECT_BATCH_LANES <= count; i += RECT_BATCH_LANES) {
+		__m128 x0 = _mm_loadu_ps(batch->x + first + i);
+		__m128 y0 = _mm_loadu_ps(batch->y + first + i);
+		__m128 x1 = _mm_add_ps(x0, _mm_loadu_ps(batch->w + first + i));
+		__m128 y1 = _mm_add_ps(y0, _mm_loadu_ps(batch->h + first + i));
+
+		__m128 hit = _mm_and_ps(
+			_mm_and_ps(_mm_cmple_ps(x0, qx1), _mm_cmple_ps(qx0, x1)),
+			_mm_and_ps(_mm_cmple_ps(y0, qy1), _mm_cmple_ps(qy0, y1))
+		);
+		mask |= (u32) _mm_movemask_ps(hit) << i;
+	}
+#endif
+
+	// What is left over, or everything without sse
+	for (; i < count; i++) {
+		u32 j = first + i;
+		b32 hit =
+			batch->x[j] <= rect.x + rect.w && rect.x <= batch->x[j] + batch->w[j] &&
+			batch->y[j] <= rect.y + rect.h && rect.y <= batch->y[j] + batch->h[j];
+		mask |= (u32) hit << i;
+	}
+	return mask;
+}
+
+// A rect moving by d hits another where its corner, as a segment, enters the other
+// grown by the size of the moving one. Segments are rects without a size.
+static u32 rect_batch_cast(RectBatch* batch, u32 first, u32 count, v2 p0, v2 d, v2 size, b32 from_inside, f32* t) {
+	panic(count <= 32, "Too many rects for a batch mask: %d\n", count);
+
+	// The segment is the same for every lane, so whether an axis is parallel is decided once
+	f32 inv_x = d.x != 0.0f ? 1.0f / d.x : 0.0f;
+	f32 inv_y = d.y != 0.0f ? 1.0f / d.y : 0.0f;
+	f32 t_start = from_inside ? 0.0f : -INFINITY;
+
+	u32 mask = 0;
+	u32 i = 0;
+#ifdef __SSE2__
+	__m128 ox = _mm_set1_ps(p0.x);
+	__m128 oy = _mm_set1_ps(p0.y);
+	__m128 ix = _mm_set1_ps(inv_x);
+	__m128 iy = _mm_set1_ps(inv_y);
+	__m128 sw = _mm_set1_ps(size.x);
+	__m128 sh = _mm_set1_ps(size.y);
+
+	for (; i + RECT_BATCH_LANES <= count; i += RECT_BATCH_LANES) {
+		__m128 x0 = _mm_sub_ps(_mm_loadu_ps(batch->x + first + i), sw);
+		__m128 y0 = _mm_sub_ps(_mm_loadu_ps(batch->y + first + i), sh);
+		__m128 x1 = _mm_add_ps(_mm_loadu_ps(batch->x + first + i), _mm_loadu_ps(batch->w + first + i));
+		__m128 y1 = _mm_add_ps(_mm_loadu_ps(batch->y + first + i), _mm_loadu_ps(batch->h + first + i));
+
+		__m128 tmin = _mm_set1_ps(t_start);
+		__m128 tmax = _mm_set1_ps(1.0f);
+		__m128 hit = _mm_castsi128_ps(_mm_set1_epi32(-1));
+
+		if (d.x == 0.0f) {
+			hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmple_ps(x0, ox), _mm_cmple_ps(ox, x1)));
+		} else {
+			__m128 t1 = _mm_mul_ps(_mm_sub_ps(x0, ox), ix);
+			__m128 t2 = _mm_mul_ps(_mm_sub_ps(x1, ox), ix);
+			tmin = _mm_max_ps(tmin, _mm_min_ps(t1, t2));
+			tmax = _mm_min_ps(tmax, _mm_max_ps(t1, t2));
+		}
+
+		if (d.y == 0.0f) {
+			hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmple_ps(y0, oy), _mm_cmple_ps(oy, y1)));
+		} else {
+			__m128 t1 = _mm_mul_ps(_mm_sub_ps(y0, oy), iy);
+			__m128 t2 = _mm_mul_ps(_mm_sub_ps(y1, oy), iy);
+			tmin = _mm_max_ps(tmin, _mm_min_ps(t1, t2));
+			tmax = _mm_min_ps(tmax, _mm_max_ps(t1, t2));
+		}
+
+		hit = _mm_and_ps(hit, _mm_cmple_ps(tmin, tmax));
+		hit = _mm_and_ps(hit, _mm_cmpge_ps(tmin, _mm_setzero_ps()));
+		if (t) _mm_storeu_ps(t + i, tmin);
+		mask |= (u32) _mm_movemask_ps(hit) << i;
+	}
+#endif
+
+	// What is left over, or everything without sse
+	for (; i < count; i++) {
+		u32 j = first + i;
+		f32 x0 = batch->x[j] - size.x;
+		f32 y0 = batch->y[j] - size.y;
+		f32 x1 = batch->x[j] + batch->w[j];
+		f32 y1 = batch->y[j] + batch->h[j];
+
+		f32 tmin = t_start;
+		f32 tmax = 1.0f;
+		b32 hit = true;
+
+		if (d.x == 0.0f) {
+			hit &= x0 <= p0.x && p0.x <= x1;
+		} else {
+			f32 t1 = (x0 - p0.x) * inv_x;
+			f32 t2 = (x1 - p0.x) * inv_x;
+			tmin = fmaxf(tmin, fminf(t1, t2));
+			tmax = fminf(tmax, fmaxf(t1, t2));
+		}
+
+		if (d.y == 0.0f) {
+			hit &= y0 <= p0.y && p0.y <= y1;
+		} else {
+			f32 t1 = (y0 - p0.y) * inv_y;
+			f32 t2 = (y1 - p0.y) * inv_y;
+			tmin = fmaxf(tmin, fminf(t1, t2));
+			tmax = fminf(tmax, fmaxf(t1, t2));
+		}
+
+		hit &= tmin <= tmax && tmin >= 0.0f;
+		if (t) t[i] = tmin;
+		mask |= (u32) hit << i;
+	}
+	return mask;
+}
+
+u32 rect_batch_segment(RectBatch* batch, u32 first, u32 count, v2 p0, v2 p1, f32* t) {
+	v2 d = { p1.x - p0.x, p1.y - p0.y };
+	return rect_batch_cast(batch, first, count, p0, d, (v2) { 0, 0 }, true, t);
+}
+
+u32 rect_batch_sweep(RectBatch* batch, u32 first, u32 count, Rect rect, v2 delta, f32* t) {
+	v2 p0 = { rect.x, rect.y };
+	return rect_batch_cast(batch, first, count, p0, delta, (v2) { rect.w, rect.h }, false, t);
+}
+
 // :window impl
 Window window_new(const char* title, u32 width, u32 height) {
 	// Initialize the context
@@ -1122,12 +1976,16 @@ Window window_new(const char* title, u32 width, u32 height) {
 	glfwMakeContextCurrent(glfw_window);
 	panic(glewInit() == GLEW_OK, "Failed to initialize glew\n");
 
+	ctx->win_width = width;
+	ctx->win_height = height;
+
 	b32 should_close = glfwWindowShouldClose(glfw_window);
 	return (Window) {
 		.glfw_window = glfw_window,
 		.width = width,
 		.height = height,
-		.should_close = should_close
+		.should_close = should_close,
+		.focused = glfwGetWindowAttrib(glfw_window, GLFW_FOCUSED),
 	};
 }
 
@@ -1142,6 +2000,7 @@ void window_update(Window* window) {
 	window->should_close = glfwWindowShouldClose(window->glfw_window);
 	glfwSwapBuffers(window->glfw_window);
 	glfwPollEvents();
+	window->focused = glfwGetWindowAttrib(window->glfw_window, GLFW_FOCUSED);
 }
 
 // :frame controller impl
@@ -1152,7 +2011,9 @@ FrameController frame_controller_new(i32 fps) {
 		.unit_frame = 1.0f / fps,
 		.dt = 0.0f,
 		.frame = 0,
-		.fps = 0
+		.fps = 0,
+		.idle = false,
+		.idle_timeout = FRAME_IDLE_TIMEOUT,
 	};
 }
 
@@ -1160,14 +2021,26 @@ void frame_controller_start(FrameController* fc) {
 	fc->start_tick = glfwGetTime();
 }
 
+void frame_controller_set_idle(FrameController* fc, b32 idle) {
+	fc->idle = idle;
+}
+
 void frame_controller_end(FrameController* fc) {
 	fc->frame++;
 
-	fc->dt = glfwGetTime() - fc->start_tick;
-	if (fc->unit_frame > fc->dt) {
-		sleep(fc->unit_frame - fc->dt);
+	if (fc->idle) {
+		// Any input wakes the loop up early
+		glfwWaitEventsTimeout(fc->idle_timeout);
+
+		// Time spent waiting is not simulated, the next update gets a regular step
+		fc->dt = fc->unit_frame;
+	} else {
+		fc->dt = glfwGetTime() - fc->start_tick;
+		if (fc->unit_frame > fc->dt) {
+			sleep(fc->unit_frame - fc->dt);
+		}
+		fc->dt = glfwGetTime() - fc->start_tick;
 	}
-	fc->dt = glfwGetTime() - fc->start_tick;
 
 	if (glfwGetTime() - fc->start_time >= 1.0f) {
 		fc->fps = fc->frame;
@@ -1176,6 +2049,362 @@ void frame_controller_end(FrameController* fc) {
 	}
 }
 
+// :fixed step impl
+FixedStep fixed_step_new(u32 rate, u32 max_ticks) {
+	panic(rate && max_ticks, "Invalid fixed step\n");
+	return (FixedStep) {
+		.step = 1.0 / rate,
+		.accumulator = 0.0,
+		.max_ticks = max_ticks,
+		.ticks = 0,
+		.alpha = 0.0f,
+	};
+}
+
+u32 fixed_step_advance(FixedStep* fs, f64 frame_dt) {
+	fs->accumulator += frame_dt;
+
+	u32 ticks = fs->accumulator / fs->step;
+	if (ticks > fs->max_ticks) {
+		ticks = fs->max_ticks;
+		fs->accumulator = fmod(fs->accumulator, fs->step) + ticks * fs->step;
+	}
+	fs->accumulator -= ticks * fs->step;
+
+	fs->ticks += ticks;
+	fs->alpha = fs->accumulator / fs->step;
+	return ticks;
+}
+
+// :slot map impl
+SlotMap slot_map_new(u32 capacity) {
+	panic(capacity && capacity <= SLOT_MAX, "Invalid slot map capacity: %d\n", capacity);
+
+	SlotMap sm = {
+		.capacity = capacity,
+		.count = 0,
+		.generations = mem_alloc(capacity * sizeof(u32)),
+		.dense = mem_alloc(capacity * sizeof(u32)),
+		.slots = mem_alloc(capacity * sizeof(u32)),
+		.free_head = 0,
+		.pending = mem_alloc(capacity * sizeof(Handle)),
+		.pending_cnt = 0,
+	};
+
+	// Every slot starts in the free list
+	for (u32 i = 0; i < capacity; i++) {
+		sm.generations[i] = 1;
+		sm.dense[i] = i + 1;
+	}
+	return sm;
+}
+
+void slot_map_delete(SlotMap* sm) {
+	mem_free(sm->generations);
+	mem_free(sm->dense);
+	mem_free(sm->slots);
+	mem_free(sm->pending);
+}
+
+Handle slot_map_create(SlotMap* sm) {
+	panic(sm->count < sm->capacity, "Slot map is full\n");
+
+	u32 slot = sm->free_head;
+	sm->free_head = sm->dense[slot];
+
+	sm->dense[slot] = sm->count;
+	sm->slots[sm->count++] = slot;
+	return (sm->generations[slot] << SLOT_INDEX_BITS) | slot;
+}
+
+u32 slot_map_index(SlotMap* sm, Handle handle) {
+	u32 slot = handle & SLOT_INDEX_MASK;
+	if (slot >= sm->capacity || sm->generations[slot] != handle >> SLOT_INDEX_BITS)
+		return DENSE_NULL;
+	return sm->dense[slot];
+}
+
+Handle slot_map_handle(SlotMap* sm, u32 index) {
+	u32 slot = sm->slots[index];
+	return (sm->generations[slot] << SLOT_INDEX_BITS) | slot;
+}
+
+u32 slot_map_destroy(SlotMap* sm, Handle handle) {
+	u32 index = slot_map_index(sm, handle);
+	if (index == DENSE_NULL) return DENSE_NULL;
+
+	u32 slot = handle & SLOT_INDEX_MASK;
+	u32 last = --sm->count;
+
+	// Moving the last item into the hole
+	u32 last_slot = sm->slots[last];
+	sm->slots[index] = last_slot;
+	sm->dense[last_slot] = index;
+
+	// Wrapping around skips 0 so that HANDLE_NULL stays invalid
+	u32 generation = (sm->generations[slot] + 1) & (0xffffffff >> SLOT_INDEX_BITS);
+	sm->generations[slot] = generation ? generation : 1;
+	sm->dense[slot] = sm->free_head;
+	sm->free_head = slot;
+	return index;
+}
+
+void slot_map_defer_destroy(SlotMap* sm, Handle handle) {
+	if (slot_map_index(sm, handle) == DENSE_NULL) return;
+	panic(sm->pending_cnt < sm->capacity, "Too many deferred destroys\n");
+
+	// Deferring twice is fine, the second one is stale by the time it is popped
+	sm->pending[sm->pending_cnt++] = handle;
+}
+
+b32 slot_map_pop_deferred(SlotMap* sm, Handle* handle) {
+	if (!sm->pending_cnt) return false;
+	*handle = sm->pending[--sm->pending_cnt];
+	return true;
+}
+
+// :spatial grid impl
+static u32 spatial_grid_hash(SpatialGrid* grid, i32 cx, i32 cy) {
+	return ((u32) cx * 73856093u ^ (u32) cy * 19349663u) & grid->buckets_mask;
+}
+
+SpatialGrid spatial_grid_new(f32 cell_size, u32 max_items) {
+	panic(cell_size > 0.0f && max_items, "Invalid spatial grid\n");
+
+	// Twice as many buckets as items keeps the chains short
+	u32 buckets_cnt = 1;
+	while (buckets_cnt < 2 * max_items) buckets_cnt <<= 1;
+
+	SpatialGrid grid = {
+		.cell_size = cell_size,
+		.max_items = max_items,
+		.buckets = mem_alloc(buckets_cnt * sizeof(u32)),
+		.buckets_mask = buckets_cnt - 1,
+		.entries_cap = 4 * max_items,
+		.entries_cnt = 0,
+		.rects = mem_alloc(max_items * sizeof(Rect)),
+		.stamps = mem_alloc(max_items * sizeof(u32)),
+		.stamp = 0,
+	};
+	grid.entries = mem_alloc(grid.entries_cap * sizeof(GridEntry));
+	memset(grid.stamps, 0, max_items * sizeof(u32));
+	spatial_grid_clear(&grid);
+	return grid;
+}
+
+void spatial_grid_delete(SpatialGrid* grid) {
+	mem_free(grid->buckets);
+	mem_free(grid->entries);
+	mem_free(grid->rects);
+	mem_free(grid->stamps);
+}
+
+void spatial_grid_clear(SpatialGrid* grid) {
+	memset(grid->buckets, 0xff, (grid->buckets_mask + 1) * sizeof(u32));
+	grid->entries_cnt = 0;
+}
+
+void spatial_grid_insert(SpatialGrid* grid, u32 item, Rect rect) {
+	panic(item < grid->max_items, "Spatial grid item out of range: %d\n", item);
+	grid->rects[item] = rect;
+
+	i32 x0 = floorf(rect.x / grid->cell_size);
+	i32 y0 = floorf(rect.y / grid->cell_size);
+	i32 x1 = floorf((rect.x + rect.w) / grid->cell_size);
+	i32 y1 = floorf((rect.y + rect.h) / grid->cell_size);
+
+	for (i32 cy = y0; cy <= y1; cy++) {
+		for (i32 cx = x0; cx <= x1; cx++) {
+			if (grid->entries_cnt == grid->entries_cap) {
+				grid->entries_cap *= 2;
+				grid->entries = mem_realloc(grid->entries, grid->entries_cap * sizeof(GridEntry));
+			}
+
+			u32 bucket = spatial_grid_hash(grid, cx, cy);
+			grid->entries[grid->entries_cnt] = (GridEntry) { item, cx, cy, grid->buckets[bucket] };
+			grid->buckets[bucket] = grid->entries_cnt++;
+		}
+	}
+}
+
+u32 spatial_grid_query(SpatialGrid* grid, Rect rect, u32* items, u32 max_items) {
+	// A new stamp forgets what the last query reported
+	if (++grid->stamp == 0) {
+		memset(grid->stamps, 0, grid->max_items * sizeof(u32));
+		grid->stamp = 1;
+	}
+
+	i32 x0 = floorf(rect.x / grid->cell_size);
+	i32 y0 = floorf(rect.y / grid->cell_size);
+	i32 x1 = floorf((rect.x + rect.w) / grid->cell_size);
+	i32 y1 = floorf((rect.y + rect.h) / grid->cell_size);
+
+	u32 items_cnt = 0;
+	for (i32 cy = y0; cy <= y1; cy++) {
+		for (i32 cx = x0; cx <= x1; cx++) {
+			u32 i = grid->buckets[spatial_grid_hash(grid, cx, cy)];
+			for (; i != GRID_NULL; i = grid->entries[i].next) {
+				GridEntry* entry = &grid->entries[i];
+				if (entry->cx != cx || entry->cy != cy) continue;
+				if (grid->stamps[entry->item] == grid->stamp) continue;
+				grid->stamps[entry->item] = grid->stamp;
+
+				if (!rect_intersect_inclusive(grid->rects[entry->item], rect)) continue;
+				if (items_cnt == max_items) return items_cnt;
+				items[items_cnt++] = entry->item;
+			}
+		}
+	}
+	return items_cnt;
+}
+
+// :collision world impl
+CollisionWorld collision_world_new() {
+	return (CollisionWorld) {
+		.rects = rect_batch_new(COLLISION_LEAF_RECTS),
+	};
+}
+
+void collision_world_delete(CollisionWorld* world) {
+	rect_batch_delete(&world->rects);
+	if (world->sorted) mem_free(world->sorted);
+	if (world->nodes) mem_free(world->nodes);
+	if (world->found) mem_free(world->found);
+}
+
+static i32 collision_sort_axis;
+static i32 collision_rect_cmp(const void* a, const void* b) {
+	const Rect* r1 = a;
+	const Rect* r2 = b;
+	f32 c1 = collision_sort_axis == 0 ? 2 * r1->x + r1->w : 2 * r1->y + r1->h;
+	f32 c2 = collision_sort_axis == 0 ? 2 * r2->x + r2->w : 2 * r2->y + r2->h;
+	return (c1 > c2) - (c1 < c2);
+}
+
+static void collision_world_split(CollisionWorld* world, u32 node, u32 first, u32 count, u32 depth) {
+	Rect bounds = world->sorted[first];
+	for (u32 i = first + 1; i < first + count; i++)
+		bounds = rect_union(bounds, world->sorted[i]);
+
+	if (count <= COLLISION_LEAF_RECTS || depth == COLLISION_MAX_DEPTH) {
+		world->nodes[node] = (CollisionNode) { bounds, first, count };
+		return;
+	}
+
+	// Halving along the longer side
+	collision_sort_axis = bounds.w >= bounds.h ? 0 : 1;
+	qsort(world->sorted + first, count, sizeof(Rect), collision_rect_cmp);
+
+	u32 left = world->nodes_cnt;
+	world->nodes_cnt += 2;
+	world->nodes[node] = (CollisionNode) { bounds, left, 0 };
+
+	u32 half = count / 2;
+	collision_world_split(world, left, first, half, depth + 1);
+	collision_world_split(world, left + 1, first + half, count - half, depth + 1);
+}
+
+void collision_world_build(CollisionWorld* world, Rect* rects, u32 rects_cnt) {
+	if (rects_cnt > world->sorted_cap) {
+		if (world->sorted) mem_free(world->sorted);
+		if (world->nodes) mem_free(world->nodes);
+
+		// A binary tree with a rect per leaf at worst
+		world->sorted_cap = rects_cnt;
+		world->nodes_cap = 2 * rects_cnt;
+		world->sorted = mem_alloc(world->sorted_cap * sizeof(Rect));
+		world->nodes = mem_alloc(world->nodes_cap * sizeof(CollisionNode));
+	}
+
+	world->rects.count = 0;
+	world->nodes_cnt = 0;
+	if (!rects_cnt) return;
+
+	memcpy(world->sorted, rects, rects_cnt * sizeof(Rect));
+	world->nodes_cnt = 1;
+	collision_world_split(world, 0, 0, rects_cnt, 0);
+
+	// The leaves are runs of the sorted rects
+	for (u32 i = 0; i < rects_cnt; i++)
+		rect_batch_push(&world->rects, world->sorted[i]);
+}
+
+Rect* collision_world_query(CollisionWorld* world, Rect area, u32* found_cnt) {
+	*found_cnt = 0;
+	if (!world->nodes_cnt) return world->found;
+
+	u32 stack[2 * COLLISION_MAX_DEPTH];
+	u32 stack_cnt = 0;
+	stack[stack_cnt++] = 0;
+
+	while (stack_cnt) {
+		CollisionNode* node = &world->nodes[stack[--stack_cnt]];
+		if (!rect_intersect_inclusive(node->bounds, area)) continue;
+
+		if (node->count == 0) {
+			stack[stack_cnt++] = node->first;
+			stack[stack_cnt++] = node->first + 1;
+			continue;
+		}
+
+		u32 mask = rect_batch_overlap(&world->rects, node->first, node->count, area);
+		for (; mask; mask &= mask - 1) {
+			if (*found_cnt == world->found_cap) {
+				world->found_cap = world->found_cap ? world->found_cap * 2 : 16;
+				if (world->found) {
+					world->found = mem_realloc(world->found, world->found_cap * sizeof(Rect));
+				} else {
+					world->found = mem_alloc(world->found_cap * sizeof(Rect));
+				}
+			}
+			world->found[(*found_cnt)++] = rect_batch_get(&world->rects, node->first + __builtin_ctz(mask));
+		}
+	}
+	return world->found;
+}
+
+b32 collision_world_sweep(CollisionWorld* world, Rect rect, v2 delta, f32* toi) {
+	if (!world->nodes_cnt) return false;
+
+	f32 closest = 2.0f;
+	f32 times[32];
+	u32 stack[2 * COLLISION_MAX_DEPTH];
+	u32 stack_cnt = 0;
+	stack[stack_cnt++] = 0;
+
+	v2 p0 = { rect.x, rect.y };
+	v2 p1 = { rect.x + delta.x, rect.y + delta.y };
+	while (stack_cnt) {
+		CollisionNode* node = &world->nodes[stack[--stack_cnt]];
+
+		// The boxes are grown by the moving rect so that its corner can be cast through them
+		Rect bounds = {
+			node->bounds.x - rect.w,
+			node->bounds.y - rect.h,
+			node->bounds.w + rect.w,
+			node->bounds.h + rect.h,
+		};
+		f32 t;
+		if (!rect_segment_hit(bounds, p0, p1, &t) || t >= closest) continue;
+
+		if (node->count == 0) {
+			stack[stack_cnt++] = node->first;
+			stack[stack_cnt++] = node->first + 1;
+			continue;
+		}
+
+		u32 mask = rect_batch_sweep(&world->rects, node->first, node->count, rect, delta, times);
+		for (; mask; mask &= mask - 1) {
+			t = times[__builtin_ctz(mask)];
+			if (t < closest) closest = t;
+		}
+	}
+
+	if (closest > 1.0f) return false;
+	if (toi) *toi = closest;
+	return true;
+}
+
 // :event impl
 void key_callback(GLFWwindow* window, i32 key, i32 scancode, i32 action, i32 mods) {
 	Event event = { 0 };
@@ -1329,6 +2558,19 @@ m4 ocamera_calc_mvp(OCamera* cam) {
 	return cam->mvp;
 }
 
+Rect ocamera_view_rect(OCamera* cam) {
+	f32 width = cam->boundary.right - cam->boundary.left;
+	f32 height = cam->boundary.bottom - cam->boundary.top;
+	v2 offset = dgl_to_dp_coords(cam->pos, width, height);
+
+	return (Rect) {
+		cam->boundary.left + offset.x,
+		cam->boundary.top + offset.y,
+		width,
+		height
+	};
+}
+
 // :pcamera impl
 PCamera pcamera_new(v3 pos, v3 dir, f32 sensitivity, PCamera_Info info) {
 	dir = v3_normalize(dir);
@@ -1439,65 +2681,122 @@ m4 pcamera_calc_mvp(PCamera* cam) {
 
 // :texture impl
 Texture texture_from_file(const char* filepath, b32 flip) {
+	return texture_from_file_ex(filepath, flip, TEXTURE_OPTIONS_DEFAULT);
+}
+
+Texture texture_from_file_ex(const char* filepath, b32 flip, TextureOptions opts) {
 	stbi_set_flip_vertically_on_load(flip);
 
 	i32 w, h, c;
 	u8* data = stbi_load(filepath, &w, &h, &c, 0);
 	panic(data, "Failed to load file: %s\n", filepath);
 
-	// Binding the texture
-	u32 id;
-	GLCall(glGenTextures(1, &id));
-	GLCall(glBindTexture(GL_TEXTURE_2D, id));
-
-	// Setting up some basic modes to display texture
-	GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
-	GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
-	GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
-	GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
-
-	// Sending the pixel data to opengl
-	GLenum internal_format, format;
-	if (c == 1) {
-		internal_format = GL_RED;
-		format = GL_RED;
-	} else if (c == 3) {
-		internal_format = GL_RGB;
-		format = GL_RGB;
-	} else if (c == 4) {
-		internal_format = GL_RGBA;
-		format = GL_RGBA;
-	}
-
-	GLCall(glTexImage2D(GL_TEXTURE_2D, 0, internal_format, w, h, 0, format, GL_UNSIGNED_BYTE, data));
-	GLCall(glBindTexture(GL_TEXTURE_2D, 0));
-
-	if (data) {
+	// Two channel images are expanded to RGBA
+	if (c == 2) {
 		stbi_image_free(data);
+		data = stbi_load(filepath, &w, &h, &c, 4);
+		c = 4;
 	}
 
-	return (Texture) {
-		id, w, h
-	};
+	GLenum format = GL_RGBA;
+	if (c == 1) format = GL_RED;
+	else if (c == 3) format = GL_RGB;
+
+	Texture texture = texture_new_ex(w, h, format, data, opts);
+	stbi_image_free(data);
+	return texture;
 }
 
 Texture texture_from_data(u32 width, u32 height, u32* data) {
-	u32 id;
-	GLCall(glGenTextures(1, &id));
-	GLCall(glBindTexture(GL_TEXTURE_2D, id));
-	
-	// Setting up some basic modes to display texture
-	GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
-	GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
-	GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
-	GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
-	
-	// Sending the pixel data to opengl
-	GLCall(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data));
-	GLCall(glBindTexture(GL_TEXTURE_2D, 0));
+	return texture_new_ex(width, height, GL_RGBA, data, TEXTURE_OPTIONS_DEFAULT);
+}
 
-	return (Texture) {
-		id, width, height
+Texture texture_from_data_ex(u32 width, u32 height, u32* data, TextureOptions opts) {
+	return texture_new_ex(width, height, GL_RGBA, data, opts);
+}
+
+// Box filters a level into the next one, odd sides drop their last row or column
+// and a side of 1 is only filtered along the other
+static void texture_downsample(const u8* src, u32 width, u32 height, u32 channels, u8* dst) {
+	u32 dst_w = width > 1 ? width / 2 : 1;
+	u32 dst_h = height > 1 ? height / 2 : 1;
+	u32 step_x = width > 1 ? channels : 0;
+	u32 step_y = height > 1 ? width * channels : 0;
+
+	for (u32 y = 0; y < dst_h; y++) {
+		for (u32 x = 0; x < dst_w; x++) {
+			const u8* p = src + (y * 2 * width + x * 2) * channels;
+			for (u32 c = 0; c < channels; c++) {
+				u32 sum = p[c] + p[c + step_x] + p[c + step_y] + p[c + step_x + step_y];
+				dst[(y * dst_w + x) * channels + c] = (sum + 2) / 4;
+			}
+		}
+	}
+}
+
+Texture texture_new_ex(u32 width, u32 height, u32 format, const void* data, TextureOptions opts) {
+	panic(
+		opts.mipmaps || opts.min_filter == GL_NEAREST || opts.min_filter == GL_LINEAR,
+		"Mip filters need mipmaps\n"
+	);
+
+	// Picking the internal format
+	// The driver compresses on upload, there is nothing to compress for empty textures
+	b32 compress = opts.compress && data;
+	GLenum internal_format = GL_RGBA8;
+	if (format == GL_RED) {
+		internal_format = (compress && GLEW_ARB_texture_compression_rgtc) ? GL_COMPRESSED_RED_RGTC1 : GL_R8;
+	} else if (format == GL_RGB) {
+		internal_format = (compress && GLEW_EXT_texture_compression_s3tc) ? GL_COMPRESSED_RGB_S3TC_DXT1_EXT : GL_RGB8;
+	} else {
+		internal_format = (compress && GLEW_EXT_texture_compression_s3tc) ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_RGBA8;
+	}
+
+	// Binding the texture
+	u32 id;
+	GLCall(glGenTextures(1, &id));
+	GLCall(glActiveTexture(GL_TEXTURE0 + TEXTURE_SCRATCH_UNIT));
+	GLCall(glBindTexture(GL_TEXTURE_2D, id));
+
+	GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, opts.min_filter));
+	GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, opts.mag_filter));
+	GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, opts.wrap_s));
+	GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, opts.wrap_t));
+
+	// Sending the pixel data to opengl
+	// Rows of single channel and rgb data are not 4 byte aligned
+	GLCall(glPixelStorei(GL_UNPACK_ALIGNMENT, 1));
+	GLCall(glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, format, GL_UNSIGNED_BYTE, data));
+
+	if (opts.mipmaps && compress) {
+		// Mipmaps arent generated from compressed levels, every level is filtered here
+		// and compressed by the driver like the first one
+		u32 channels = format == GL_RED ? 1 : format == GL_RGB ? 3 : 4;
+		u32 w = width, h = height;
+		u64 level_bytes = (u64) (w > 1 ? w / 2 : 1) * (h > 1 ? h / 2 : 1) * channels;
+		u8* levels[2] = { mem_alloc(level_bytes), mem_alloc(level_bytes) };
+		const u8* src = data;
+
+		for (i32 level = 1; w > 1 || h > 1; level++) {
+			u8* dst = levels[level & 1];
+			texture_downsample(src, w, h, channels, dst);
+			w = w > 1 ? w / 2 : 1;
+			h = h > 1 ? h / 2 : 1;
+			GLCall(glTexImage2D(GL_TEXTURE_2D, level, internal_format, w, h, 0, format, GL_UNSIGNED_BYTE, dst));
+			src = dst;
+		}
+		mem_free(levels[0]);
+		mem_free(levels[1]);
+	} else if (opts.mipmaps) {
+		GLCall(glGenerateMipmap(GL_TEXTURE_2D));
+	}
+	GLCall(glPixelStorei(GL_UNPACK_ALIGNMENT, 4));
+	GLCall(glBindTexture(GL_TEXTURE_2D, 0));
+
+	texture_registry_add(id, texture_estimate_bytes(width, height, internal_format, opts.mipmaps));
+
+	return (Texture) {
+		id, width, height
 	};
 }
 
@@ -1507,19 +2806,172 @@ void texture_clear(Texture texture) {
 }
 
 void texture_bind(Texture texture) {
-	GLCall(glActiveTexture(GL_TEXTURE0 + (i32) texture.id));
+	GLCall(glActiveTexture(GL_TEXTURE0 + TEXTURE_SCRATCH_UNIT));
 	GLCall(glBindTexture(GL_TEXTURE_2D, texture.id));
 }
 
 void texture_unbind(Texture texture) {
-	GLCall(glActiveTexture(GL_TEXTURE0 + (i32) texture.id));
+	GLCall(glActiveTexture(GL_TEXTURE0 + TEXTURE_SCRATCH_UNIT));
 	GLCall(glBindTexture(GL_TEXTURE_2D, 0));
 }
 
 void texture_delete(Texture texture) {
+	texture_registry_remove(texture.id);
+
+	// Deleting unbinds it from every unit, the id can be handed out again
+	if (ctx) {
+		for (u32 i = 0; i < TEXTURE_SAMPLE_AMT; i++) {
+			if (ctx->slots.textures[i] != texture.id) continue;
+			ctx->slots.textures[i] = 0;
+			ctx->slots.stamps[i] = 0;
+		}
+	}
 	GLCall(glDeleteTextures(1, &texture.id));
 }
 
+// :texture registry impl
+u64 texture_estimate_bytes(u32 width, u32 height, u32 internal_format, b32 mipmaps) {
+	// Bits per pixel, drivers pad rgb to 4 bytes
+	u64 bpp = 32;
+	switch (internal_format) {
+		case GL_R8: bpp = 8; break;
+		case GL_COMPRESSED_RED_RGTC1: bpp = 4; break;
+		case GL_COMPRESSED_RGB_S3TC_DXT1_EXT: bpp = 4; break;
+		case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT: bpp = 8; break;
+		default: break;
+	}
+
+	u64 bytes = (u64) width * height * bpp / 8;
+	// The whole mip chain adds a third
+	if (mipmaps) bytes += bytes / 3;
+	return bytes;
+}
+
+void texture_registry_add(u32 id, u64 bytes) {
+	if (!ctx) return;
+	TextureRegistry* reg = &ctx->textures;
+	panic(reg->entries_cnt < MAX_TRACKED_TEXTURES, "Too many live textures\n");
+
+	reg->entries[reg->entries_cnt++] = (TextureEntry) { id, bytes };
+	reg->used += bytes;
+
+	if (reg->budget && reg->used > reg->budget && !reg->over_budget) {
+		log_warn(
+			"Textures are over the vram budget: %.2f MB / %.2f MB\n",
+			reg->used / (1024.0 * 1024.0), reg->budget / (1024.0 * 1024.0)
+		);
+	}
+	reg->over_budget = reg->budget && reg->used > reg->budget;
+}
+
+void texture_registry_remove(u32 id) {
+	if (!ctx) return;
+	TextureRegistry* reg = &ctx->textures;
+
+	for (u32 i = 0; i < reg->entries_cnt; i++) {
+		if (reg->entries[i].id != id) continue;
+
+		reg->used -= reg->entries[i].bytes;
+		reg->entries[i] = reg->entries[--reg->entries_cnt];
+		break;
+	}
+	reg->over_budget = reg->budget && reg->used > reg->budget;
+}
+
+void texture_set_vram_budget(u64 bytes) {
+	TextureRegistry* reg = &ctx->textures;
+	reg->budget = bytes;
+	reg->over_budget = false;
+
+	// Warning right away if the textures are already over
+	if (bytes && reg->used > bytes) {
+		log_warn(
+			"Textures are over the vram budget: %.2f MB / %.2f MB\n",
+			reg->used / (1024.0 * 1024.0), bytes / (1024.0 * 1024.0)
+		);
+		reg->over_budget = true;
+	}
+}
+
+u64 texture_vram_used() {
+	return ctx ? ctx->textures.used : 0;
+}
+
+// :palette impl
+Palette palette_new() {
+	Palette palette = {0};
+	palette.texture = texture_from_data(PALETTE_COLORS, PALETTE_MAX_ROWS, NULL);
+	palette_add_row(&palette, (v4) { 1, 1, 1, 1 });
+	return palette;
+}
+
+void palette_delete(Palette* palette) {
+	texture_delete(palette->texture);
+}
+
+u32 palette_add_row(Palette* palette, v4 tint) {
+	panic(palette->rows_cnt < PALETTE_MAX_ROWS, "Palette is out of rows\n");
+
+	palette->tints[palette->rows_cnt] = tint;
+	palette_upload(palette);
+	return palette->rows_cnt++;
+}
+
+void palette_upload(Palette* palette) {
+	u32* pixels = mem_alloc(PALETTE_COLORS * PALETTE_MAX_ROWS * sizeof(u32));
+	memset(pixels, 0, PALETTE_COLORS * PALETTE_MAX_ROWS * sizeof(u32));
+
+	// Rows are rebuilt from the tints as sheets loaded later add new source colors
+	for (u32 row = 0; row <= palette->rows_cnt && row < PALETTE_MAX_ROWS; row++) {
+		v4 tint = palette->tints[row];
+		for (u32 i = 0; i < palette->colors_cnt; i++) {
+			u32 c = palette->colors[i];
+			u32 r = ((c >>  0) & 0xff) * tint.r;
+			u32 g = ((c >>  8) & 0xff) * tint.g;
+			u32 b = ((c >> 16) & 0xff) * tint.b;
+			u32 a = ((c >> 24) & 0xff) * tint.a;
+			pixels[row * PALETTE_COLORS + i] = r | (g << 8) | (b << 16) | (a << 24);
+		}
+	}
+
+	texture_bind(palette->texture);
+	GLCall(glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, PALETTE_COLORS, PALETTE_MAX_ROWS, GL_RGBA, GL_UNSIGNED_BYTE, pixels));
+	GLCall(glBindTexture(GL_TEXTURE_2D, 0));
+	mem_free(pixels);
+}
+
+Texture texture_from_file_indexed(const char* filepath, b32 flip, Palette* palette) {
+	stbi_set_flip_vertically_on_load(flip);
+
+	i32 w, h, c;
+	u32* data = (u32*) stbi_load(filepath, &w, &h, &c, 4);
+	panic(data, "Failed to load file: %s\n", filepath);
+
+	// Converting the pixels into indices of the palette
+	u8* indices = mem_alloc(w * h);
+	for (i32 i = 0; i < w * h; i++) {
+		u32 color = data[i];
+		// Every fully transparent pixel shares one index
+		if (!(color >> 24)) color = 0;
+
+		u32 idx = 0;
+		while (idx < palette->colors_cnt && palette->colors[idx] != color) idx++;
+		if (idx == palette->colors_cnt) {
+			panic(idx < PALETTE_COLORS, "Palette is out of colors while loading: %s\n", filepath);
+			palette->colors[palette->colors_cnt++] = color;
+		}
+		indices[i] = idx;
+	}
+	stbi_image_free(data);
+
+	// Indices can not be filtered, mipmapped or compressed
+	Texture texture = texture_new_ex(w, h, GL_RED, indices, TEXTURE_OPTIONS_DEFAULT);
+	mem_free(indices);
+
+	palette_upload(palette);
+	return texture;
+}
+
 // :shader impl
 Shader shader_new(const char* v_src, const char* f_src) {
 	u32 program = glCreateProgram();
@@ -1568,6 +3020,10 @@ u32 shader_compile(ShaderType type, const char* shader_src) {
 
 // :fbo impl
 FBO fbo_new(u32 width, u32 height) {
+	return fbo_new_ex(width, height, TEXTURE_OPTIONS_DEFAULT);
+}
+
+FBO fbo_new_ex(u32 width, u32 height, TextureOptions opts) {
 	u32 id;
 
 	// Generate and bind framebuffer
@@ -1575,7 +3031,7 @@ FBO fbo_new(u32 width, u32 height) {
 	GLCall(glBindFramebuffer(GL_FRAMEBUFFER, id));
 
 	// Color texture
-	Texture color_texture = texture_from_data(width, height, NULL);
+	Texture color_texture = texture_new_ex(width, height, GL_RGBA, NULL, opts);
 	GLCall(glFramebufferTexture2D(
 		GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
 		GL_TEXTURE_2D, color_texture.id, 0
@@ -1605,13 +3061,69 @@ void fbo_delete(FBO* fbo) {
 }
 
 void fbo_bind(FBO* fbo) {
-	texture_bind(fbo->color_texture);
-	texture_clear(fbo->color_texture);
-	GLCall(glBindFramebuffer(GL_FRAMEBUFFER, fbo->id));
+	fbo_bind_region(fbo, fbo->color_texture.width, fbo->color_texture.height);
+}
+
+void fbo_bind_region(FBO* fbo, u32 width, u32 height) {
+	panic(ctx->targets_cnt < MAX_RENDER_TARGETS, "Render target stack overflow\n");
+
+	RenderTarget target = {
+		fbo->id,
+		fbo->color_texture.id,
+		width,
+		height
+	};
+	ctx->targets[ctx->targets_cnt++] = target;
+	fbo_apply_target(target);
 }
 
 void fbo_unbind() {
-	GLCall(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+	panic(ctx->targets_cnt > 0, "Render target stack underflow\n");
+	ctx->targets_cnt--;
+
+	fbo_apply_target(fbo_current_target());
+}
+
+RenderTarget fbo_current_target() {
+	if (ctx->targets_cnt)
+		return ctx->targets[ctx->targets_cnt - 1];
+	return (RenderTarget) { 0, 0, ctx->win_width, ctx->win_height };
+}
+
+void fbo_copy_from_target(FBO* fbo) {
+	RenderTarget target = fbo_current_target();
+	Texture tex = fbo->color_texture;
+
+	GLCall(glBindFramebuffer(GL_READ_FRAMEBUFFER, target.id));
+	GLCall(glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo->id));
+	GLCall(glBlitFramebuffer(
+		0, 0, target.width, target.height,
+		0, 0, tex.width, tex.height,
+		GL_COLOR_BUFFER_BIT, GL_NEAREST
+	));
+	GLCall(glBindFramebuffer(GL_FRAMEBUFFER, target.id));
+}
+
+void fbo_copy_to_target(FBO* fbo) {
+	RenderTarget target = fbo_current_target();
+	Texture tex = fbo->color_texture;
+
+	GLCall(glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo->id));
+	GLCall(glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target.id));
+	GLCall(glBlitFramebuffer(
+		0, 0, tex.width, tex.height,
+		0, 0, target.width, target.height,
+		GL_COLOR_BUFFER_BIT, GL_NEAREST
+	));
+	GLCall(glBindFramebuffer(GL_FRAMEBUFFER, target.id));
+}
+
+void fbo_apply_target(RenderTarget target) {
+	if (ctx->capture)
+		imr_capture_write(ctx->capture, IMR_CMD_TARGET, &target, sizeof(target));
+
+	GLCall(glBindFramebuffer(GL_FRAMEBUFFER, target.id));
+	GLCall(glViewport(0, 0, target.width, target.height));
 }
 
 // :imr impl
@@ -1622,16 +3134,19 @@ const char* __internal_v_src =
 	"layout (location = 2) in vec2 tex_coord;\n"
 	"layout (location = 3) in float tex_id;\n"
 	"layout (location = 4) in vec4 overlay_color;\n"
+	"layout (location = 5) in float palette;\n"
 	"uniform mat4 mvp;\n"
 	"out vec4 o_color;\n"
 	"out vec2 o_tex_coord;\n"
 	"out float o_tex_id;\n"
 	"out vec4 o_overlay_color;\n"
+	"out float o_palette;\n"
 	"void main() {\n"
 	"o_color = color;\n"
 	"o_tex_coord = tex_coord;\n"
 	"o_tex_id = tex_id;\n"
 	"o_overlay_color = overlay_color;\n"
+	"o_palette = palette;\n"
 	"gl_Position = mvp * vec4(position, 1.0f);\n"
 	"}\n";
 
@@ -1639,67 +3154,59 @@ const char* __internal_f_src =
 	"#version 330 core\n"
 	"layout (location = 0) out vec4 color;\n"
 	"uniform sampler2D textures[32];\n"
+	"uniform sampler2D palette;\n"
 	"in vec4 o_color;\n"
 	"in vec2 o_tex_coord;\n"
 	"in float o_tex_id;\n"
 	"in vec4 o_overlay_color;\n"
+	"in float o_palette;\n"
 	"void main() {\n"
 	"int index = int(o_tex_id);\n"
 	"vec4 t_color;\n"
 	"switch (index) {\n"
-	"case 0: t_color = texture(textures[0], o_tex_coord) * o_color; break;\n"
-	"case 1: t_color = texture(textures[1], o_tex_coord) * o_color; break;\n"
-	"case 2: t_color = texture(textures[2], o_tex_coord) * o_color; break;\n"
-	"case 3: t_color = texture(textures[3], o_tex_coord) * o_color; break;\n"
-	"case 4: t_color = texture(textures[4], o_tex_coord) * o_color; break;\n"
-	"case 5: t_color = texture(textures[5], o_tex_coord) * o_color; break;\n"
-	"case 6: t_color = texture(textures[6], o_tex_coord) * o_color; break;\n"
-	"case 7: t_color = texture(textures[7], o_tex_coord) * o_color; break;\n"
-	"case 8: t_color = texture(textures[8], o_tex_coord) * o_color; break;\n"
-	"case 9: t_color = texture(textures[9], o_tex_coord) * o_color; break;\n"
-	"case 10: t_color = texture(textures[10], o_tex_coord) * o_color; break;\n"
-	"case 11: t_color = texture(textures[11], o_tex_coord) * o_color; break;\n"
-	"case 12: t_color = texture(textures[12], o_tex_coord) * o_color; break;\n"
-	"case 13: t_color = texture(textures[13], o_tex_coord) * o_color; break;\n"
-	"case 14: t_color = texture(textures[14], o_tex_coord) * o_color; break;\n"
-	"case 15: t_color = texture(textures[15], o_tex_coord) * o_color; break;\n"
-	"case 16: t_color = texture(textures[16], o_tex_coord) * o_color; break;\n"
-	"case 17: t_color = texture(textures[17], o_tex_coord) * o_color; break;\n"
-	"case 18: t_color = texture(textures[18], o_tex_coord) * o_color; break;\n"
-	"case 19: t_color = texture(textures[19], o_tex_coord) * o_color; break;\n"
-	"case 20: t_color = texture(textures[20], o_tex_coord) * o_color; break;\n"
-	"case 21: t_color = texture(textures[21], o_tex_coord) * o_color; break;\n"
-	"case 22: t_color = texture(textures[22], o_tex_coord) * o_color; break;\n"
-	"case 23: t_color = texture(textures[23], o_tex_coord) * o_color; break;\n"
-	"case 24: t_color = texture(textures[24], o_tex_coord) * o_color; break;\n"
-	"case 25: t_color = texture(textures[25], o_tex_coord) * o_color; break;\n"
-	"case 26: t_color = texture(textures[26], o_tex_coord) * o_color; break;\n"
-	"case 27: t_color = texture(textures[27], o_tex_coord) * o_color; break;\n"
-	"case 28: t_color = texture(textures[28], o_tex_coord) * o_color; break;\n"
-	"case 29: t_color = texture(textures[29], o_tex_coord) * o_color; break;\n"
-	"case 30: t_color = texture(textures[30], o_tex_coord) * o_color; break;\n"
-	"case 31: t_color = texture(textures[31], o_tex_coord) * o_color; break;\n"
+	"case 0: t_color = texture(textures[0], o_tex_coord); break;\n"
+	"case 1: t_color = texture(textures[1], o_tex_coord); break;\n"
+	"case 2: t_color = texture(textures[2], o_tex_coord); break;\n"
+	"case 3: t_color = texture(textures[3], o_tex_coord); break;\n"
+	"case 4: t_color = texture(textures[4], o_tex_coord); break;\n"
+	"case 5: t_color = texture(textures[5], o_tex_coord); break;\n"
+	"case 6: t_color = texture(textures[6], o_tex_coord); break;\n"
+	"case 7: t_color = texture(textures[7], o_tex_coord); break;\n"
+	"case 8: t_color = texture(textures[8], o_tex_coord); break;\n"
+	"case 9: t_color = texture(textures[9], o_tex_coord); break;\n"
+	"case 10: t_color = texture(textures[10], o_tex_coord); break;\n"
+	"case 11: t_color = texture(textures[11], o_tex_coord); break;\n"
+	"case 12: t_color = texture(textures[12], o_tex_coord); break;\n"
+	"case 13: t_color = texture(textures[13], o_tex_coord); break;\n"
+	"case 14: t_color = texture(textures[14], o_tex_coord); break;\n"
+	"case 15: t_color = texture(textures[15], o_tex_coord); break;\n"
+	"case 16: t_color = texture(textures[16], o_tex_coord); break;\n"
+	"case 17: t_color = texture(textures[17], o_tex_coord); break;\n"
+	"case 18: t_color = texture(textures[18], o_tex_coord); break;\n"
+	"case 19: t_color = texture(textures[19], o_tex_coord); break;\n"
+	"case 20: t_color = texture(textures[20], o_tex_coord); break;\n"
+	"case 21: t_color = texture(textures[21], o_tex_coord); break;\n"
+	"case 22: t_color = texture(textures[22], o_tex_coord); break;\n"
+	"case 23: t_color = texture(textures[23], o_tex_coord); break;\n"
+	"case 24: t_color = texture(textures[24], o_tex_coord); break;\n"
+	"case 25: t_color = texture(textures[25], o_tex_coord); break;\n"
+	"case 26: t_color = texture(textures[26], o_tex_coord); break;\n"
+	"case 27: t_color = texture(textures[27], o_tex_coord); break;\n"
+	"case 28: t_color = texture(textures[28], o_tex_coord); break;\n"
+	"case 29: t_color = texture(textures[29], o_tex_coord); break;\n"
+	"case 30: t_color = texture(textures[30], o_tex_coord); break;\n"
+	"case 31: t_color = texture(textures[31], o_tex_coord); break;\n"
+	"}\n"
+	"if (o_palette >= 0.0f) {\n"
+	"t_color = texelFetch(palette, ivec2(int(t_color.r * 255.0f + 0.5f), int(o_palette)), 0);\n"
 	"}\n"
+	"t_color *= o_color;\n"
 	"color = mix(t_color, vec4(o_overlay_color.rgb, t_color.a), o_overlay_color.a);\n"
 	"}\n";
 
-IMR imr_new() {
-	u32 vao, vbo;
-
-	GLCall(glEnable(GL_BLEND));
-	GLCall(glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA));
-
-	// Buffers
-	GLCall(glGenVertexArrays(1, &vao));
-	GLCall(glBindVertexArray(vao));
-
-	GLCall(glGenBuffers(1, &vbo));
-	GLCall(glBindBuffer(GL_ARRAY_BUFFER, vbo));
-	GLCall(glBufferData(GL_ARRAY_BUFFER, MAX_VBO_SIZE, NULL, GL_DYNAMIC_DRAW));
-
-	// VAO format
+static void imr_vertex_format() {
 	STATIC_ASSERT(
-		14 == sizeof(Vertex) / sizeof(f32),
+		15 == sizeof(Vertex) / sizeof(f32),
 		"Vertex has been updated. Update VAO format."
 	);
 
@@ -1713,11 +3220,35 @@ IMR imr_new() {
 	GLCall(glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, sizeof(Vertex), (const void*) offsetof(Vertex, tex_id)));
 	GLCall(glEnableVertexAttribArray(4));
 	GLCall(glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (const void*) offsetof(Vertex, overlay_color)));
+	GLCall(glEnableVertexAttribArray(5));
+	GLCall(glVertexAttribPointer(5, 1, GL_FLOAT, GL_FALSE, sizeof(Vertex), (const void*) offsetof(Vertex, palette)));
+}
+
+IMR imr_new(IMR_Config config) {
+	panic(config.init_verts && config.init_verts <= config.max_verts, "Invalid imr config\n");
+	u32 vao, vbo;
+	u32 cap = config.init_verts * VERTEX_SIZE;
+
+	GLCall(glEnable(GL_BLEND));
+	GLCall(glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA));
+
+	// Buffers
+	GLCall(glGenVertexArrays(1, &vao));
+	GLCall(glBindVertexArray(vao));
+
+	GLCall(glGenBuffers(1, &vbo));
+	GLCall(glBindBuffer(GL_ARRAY_BUFFER, vbo));
+	GLCall(glBufferData(GL_ARRAY_BUFFER, cap * sizeof(f32), NULL, GL_DYNAMIC_DRAW));
+
+	imr_vertex_format();
 
-	// Generating white texture
-	u32 data = 0xffffffff;
-	Texture white = texture_from_data(1, 1, &data);
-	texture_bind(white);
+	// Generating the shared white texture
+	TextureSlots* slots = &ctx->slots;
+	if (!slots->white_refs++) {
+		u32 data = 0xffffffff;
+		slots->white = texture_from_data(1, 1, &data);
+		imr_bind_slot(0, slots->white.id);
+	}
 
 	// Shader
 	Shader shader = shader_new(__internal_v_src, __internal_f_src);
@@ -1733,50 +3264,142 @@ IMR imr_new() {
 	panic(loc != -1, "Cannot find uniform: textures\n");
 	GLCall(glUniform1iv(loc, TEXTURE_SAMPLE_AMT, samplers));
 
+	loc = GLCall(glGetUniformLocation(shader, "palette"));
+	GLCall(glUniform1i(loc, PALETTE_UNIT));
+
 	return (IMR) {
 		.vao = vao,
 		.vbo = vbo,
 		.shader = shader,
 		.def_shader = shader,
+		.buffer = mem_alloc(cap * sizeof(f32)),
 		.buff_idx = 0,
-		.white = white
+		.buff_cap = cap,
+		.max_cap = config.max_verts * VERTEX_SIZE,
+		.vbo_cap = cap,
+		.white = slots->white
 	};
 }
 
 void imr_delete(IMR* imr) {
+	mem_free(imr->buffer);
 	GLCall(glDeleteVertexArrays(1, &imr->vao));
 	GLCall(glDeleteBuffers(1, &imr->vbo));
-	texture_delete(imr->white);
+	if (!--ctx->slots.white_refs) {
+		texture_delete(ctx->slots.white);
+		ctx->slots.white = (Texture) {0};
+	}
 	shader_delete(imr->shader);
 	shader_delete(imr->def_shader);
 }
 
 void imr_clear(v4 color) {
+	if (ctx && ctx->capture)
+		imr_capture_write(ctx->capture, IMR_CMD_CLEAR, &color, sizeof(color));
+
 	GLCall(glClearColor(color.r, color.g, color.b, color.a));
 	GLCall(glClear(GL_COLOR_BUFFER_BIT));
 }
 
+void imr_blend(u32 src, u32 dst) {
+	if (ctx && ctx->capture) {
+		u32 cmd[2] = { src, dst };
+		imr_capture_write(ctx->capture, IMR_CMD_BLEND, cmd, sizeof(cmd));
+	}
+
+	GLCall(glBlendFunc(src, dst));
+}
+
+void imr_blend_separate(u32 src, u32 dst, u32 src_alpha, u32 dst_alpha) {
+	if (ctx && ctx->capture) {
+		u32 cmd[4] = { src, dst, src_alpha, dst_alpha };
+		imr_capture_write(ctx->capture, IMR_CMD_BLEND, cmd, sizeof(cmd));
+	}
+
+	GLCall(glBlendFuncSeparate(src, dst, src_alpha, dst_alpha));
+}
+
 void imr_begin(IMR* imr) {
 	imr->buff_idx = 0;
-	texture_bind(imr->white);
+	imr->slots_used = 1; // white
 	GLCall(glUseProgram(imr->shader));
 	GLCall(glBindBuffer(GL_ARRAY_BUFFER, imr->vbo));
 }
 
 void imr_end(IMR* imr) {
+	if (ctx && ctx->capture)
+		imr_capture_write(ctx->capture, IMR_CMD_DRAW, imr->buffer, imr->buff_idx * sizeof(f32));
+
+	// The gl buffer follows the size of the cpu buffer
 	GLCall(glBindBuffer(GL_ARRAY_BUFFER, imr->vbo));
-	GLCall(glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(imr->buffer), imr->buffer));
+	if (imr->vbo_cap < imr->buff_cap) {
+		GLCall(glBufferData(GL_ARRAY_BUFFER, imr->buff_cap * sizeof(f32), NULL, GL_DYNAMIC_DRAW));
+		imr->vbo_cap = imr->buff_cap;
+	}
+	GLCall(glBufferSubData(GL_ARRAY_BUFFER, 0, imr->buff_idx * sizeof(f32), imr->buffer));
+
+	imr_draw_arrays(imr, imr->vao, imr->buff_idx / VERTEX_SIZE);
+}
+
+void imr_draw_arrays(IMR* imr, u32 vao, u32 verts) {
+	GLCall(glUseProgram(imr->shader));
+	GLCall(glBindVertexArray(vao));
+	if (!imr->views_cnt) {
+		GLCall(glDrawArrays(GL_TRIANGLES, 0, verts));
+		return;
+	}
+
+	// The vertices are uploaded once and only the draw is repeated for every view
+	RenderTarget target = fbo_current_target();
+	i32 loc = GLCall(glGetUniformLocation(imr->shader, "mvp"));
+	GLCall(glEnable(GL_SCISSOR_TEST));
+	for (u32 i = 0; i < imr->views_cnt; i++) {
+		IMR_View* view = &imr->views[i];
+		i32 x = view->viewport.x * target.width;
+		i32 y = view->viewport.y * target.height;
+		i32 w = view->viewport.w * target.width;
+		i32 h = view->viewport.h * target.height;
+
+		GLCall(glViewport(x, y, w, h));
+		GLCall(glScissor(x, y, w, h));
+		GLCall(glUniformMatrix4fv(loc, 1, GL_TRUE, &view->mvp.m[0][0]));
+		GLCall(glDrawArrays(GL_TRIANGLES, 0, verts));
+	}
+	GLCall(glDisable(GL_SCISSOR_TEST));
+
+	GLCall(glViewport(0, 0, target.width, target.height));
+	GLCall(glUniformMatrix4fv(loc, 1, GL_TRUE, &imr->mvp.m[0][0]));
+}
+
+void imr_reserve(IMR* imr, u32 verts) {
+	u32 needed = imr->buff_idx + verts * VERTEX_SIZE;
+	if (needed <= imr->buff_cap) return;
+
+	if (needed > imr->max_cap) {
+		imr_end(imr);
+		imr_begin(imr);
+		return;
+	}
 
-	GLCall(glBindVertexArray(imr->vao));
-	GLCall(glDrawArrays(GL_TRIANGLES, 0, imr->buff_idx / VERTEX_SIZE));
+	u32 cap = imr->buff_cap;
+	while (cap < needed) cap *= 2;
+	if (cap > imr->max_cap) cap = imr->max_cap;
+
+	imr->buffer = mem_realloc(imr->buffer, cap * sizeof(f32));
+	imr->buff_cap = cap;
 }
 
 void imr_switch_shader(IMR* imr, Shader shader) {
 	imr->shader = shader;
+
+	if (ctx && ctx->capture) {
+		u32 cmd[2] = { shader, shader == imr->def_shader };
+		imr_capture_write(ctx->capture, IMR_CMD_SHADER, cmd, sizeof(cmd));
+	}
 }
 
 void imr_switch_shader_to_default(IMR* imr) {
-	imr->shader = imr->def_shader;
+	imr_switch_shader(imr, imr->def_shader);
 	imr_reapply_samplers(imr);
 }
 
@@ -1792,16 +3415,89 @@ void imr_reapply_samplers(IMR* imr) {
 	int loc = GLCall(glGetUniformLocation(imr->shader, "textures"));
 	panic(loc != -1, "Cannot find uniform: textures\n");
 	GLCall(glUniform1iv(loc, TEXTURE_SAMPLE_AMT, samplers));
+
+	loc = GLCall(glGetUniformLocation(imr->shader, "palette"));
+	if (loc != -1) {
+		GLCall(glUniform1i(loc, PALETTE_UNIT));
+	}
 }
 
 void imr_update_mvp(IMR* imr, m4 mvp) {
+	if (ctx && ctx->capture)
+		imr_capture_write(ctx->capture, IMR_CMD_MVP, &mvp, sizeof(mvp));
+
+	imr->mvp = mvp;
+	GLCall(glUseProgram(imr->shader));
 	i32 loc = GLCall(glGetUniformLocation(imr->shader, "mvp"));
 	GLCall(glUniformMatrix4fv(loc, 1, GL_TRUE, &mvp.m[0][0]));
 }
 
+void imr_set_views(IMR* imr, IMR_View* views, u32 views_cnt) {
+	panic(views_cnt <= MAX_IMR_VIEWS, "Too many imr views: %d\n", views_cnt);
+
+	if (ctx && ctx->capture) {
+		u32 size = sizeof(u32) + views_cnt * sizeof(IMR_View);
+		u8 cmd[sizeof(u32) + MAX_IMR_VIEWS * sizeof(IMR_View)];
+		memcpy(cmd, &views_cnt, sizeof(u32));
+		if (views_cnt) memcpy(cmd + sizeof(u32), views, views_cnt * sizeof(IMR_View));
+		imr_capture_write(ctx->capture, IMR_CMD_VIEWS, cmd, size);
+	}
+
+	if (views_cnt) memcpy(imr->views, views, views_cnt * sizeof(IMR_View));
+	imr->views_cnt = views_cnt;
+}
+
+void imr_set_palette(IMR* imr, Palette* palette) {
+	imr_bind_slot(PALETTE_UNIT, palette->texture.id);
+}
+
+u32 imr_texture_slot(IMR* imr, u32 texture_id) {
+	TextureSlots* slots = &ctx->slots;
+	if (!texture_id || texture_id == imr->white.id) return 0;
+
+	// Already resident
+	for (u32 i = 1; i < PALETTE_UNIT; i++) {
+		if (slots->textures[i] != texture_id) continue;
+
+		slots->stamps[i] = ++slots->clock;
+		imr->slots_used |= 1u << i;
+		return i;
+	}
+
+	// Every slot is referenced by the batch, it has to be drawn before one can be replaced
+	u32 free_mask = ~imr->slots_used & ~(1u << PALETTE_UNIT) & ~1u;
+	if (!free_mask) {
+		imr_end(imr);
+		imr_begin(imr);
+	}
+
+	// Evicting the least recently used slot that the batch doesnt reference
+	u32 slot = 0;
+	for (u32 i = 1; i < PALETTE_UNIT; i++) {
+		if (imr->slots_used & (1u << i)) continue;
+		if (!slot || slots->stamps[i] < slots->stamps[slot]) slot = i;
+	}
+
+	imr_bind_slot(slot, texture_id);
+	slots->stamps[slot] = ++slots->clock;
+	imr->slots_used |= 1u << slot;
+	return slot;
+}
+
+void imr_bind_slot(u32 slot, u32 texture_id) {
+	if (ctx->capture) {
+		u32 cmd[2] = { slot, texture_id };
+		imr_capture_write(ctx->capture, IMR_CMD_BIND, cmd, sizeof(cmd));
+	}
+
+	ctx->slots.textures[slot] = texture_id;
+	GLCall(glActiveTexture(GL_TEXTURE0 + slot));
+	GLCall(glBindTexture(GL_TEXTURE_2D, texture_id));
+}
+
 void imr_push_vertex(IMR* imr, Vertex v) {
 	STATIC_ASSERT(
-		14 == sizeof(Vertex) / sizeof(f32),
+		15 == sizeof(Vertex) / sizeof(f32),
 		"Vertex has been updated. Update this method."
 	);
 
@@ -1819,6 +3515,7 @@ void imr_push_vertex(IMR* imr, Vertex v) {
 	imr->buffer[imr->buff_idx++] = v.overlay_color.g;
 	imr->buffer[imr->buff_idx++] = v.overlay_color.b;
 	imr->buffer[imr->buff_idx++] = v.overlay_color.a;
+	imr->buffer[imr->buff_idx++] = v.palette;
 }
 
 void imr_push_quad(IMR* imr, v3 pos, v2 size, m4 rot, v4 color) {
@@ -1840,10 +3537,12 @@ void imr_push_quad_tex(IMR* imr, v3 pos, v2 size, Rect tex_rect, f32 tex_id, m4
 }
 
 void imr_push_quad_tex_overlay(IMR* imr, v3 pos, v2 size, Rect tex_rect, f32 tex_id, m4 rot, v4 color, v4 overlay_color) {
-	if (((imr->buff_idx + 6 * VERTEX_SIZE) / VERTEX_SIZE) >= MAX_VERT_CNT) {
-		imr_end(imr);
-		imr_begin(imr);
-	}
+	imr_push_quad_tex_palette(imr, pos, size, tex_rect, tex_id, PALETTE_NONE, rot, color, overlay_color);
+}
+
+void imr_push_quad_tex_palette(IMR* imr, v3 pos, v2 size, Rect tex_rect, f32 tex_id, f32 palette_row, m4 rot, v4 color, v4 overlay_color) {
+	imr_reserve(imr, 6);
+	f32 slot = imr_texture_slot(imr, tex_id);
 
 	Vertex p1, p2, p3, p4, p5, p6;
 
@@ -1874,8 +3573,9 @@ void imr_push_quad_tex_overlay(IMR* imr, v3 pos, v2 size, Rect tex_rect, f32 tex
 	p6.tex_coord = (v2) { tex_rect.x, tex_rect.y };
 
 	p1.color = p2.color = p3.color = p4.color = p5.color = p6.color = color;
-	p1.tex_id = p2.tex_id = p3.tex_id = p4.tex_id = p5.tex_id = p6.tex_id = tex_id;
+	p1.tex_id = p2.tex_id = p3.tex_id = p4.tex_id = p5.tex_id = p6.tex_id = slot;
 	p1.overlay_color = p2.overlay_color = p3.overlay_color = p4.overlay_color = p5.overlay_color = p6.overlay_color = overlay_color;
+	p1.palette = p2.palette = p3.palette = p4.palette = p5.palette = p6.palette = palette_row;
 
 	imr_push_vertex(imr, p1);
 	imr_push_vertex(imr, p2);
@@ -1895,10 +3595,8 @@ void imr_push_triangle(IMR* imr, v3 p1, v3 p2, v3 p3, m4 rot, v4 color) {
 }
 
 void imr_push_triangle_tex(IMR* imr, v3 p1, v3 p2, v3 p3, Triangle tex_coord, f32 tex_id, m4 rot, v4 color) {
-	if (((imr->buff_idx + 3 * VERTEX_SIZE) / VERTEX_SIZE) >= MAX_VERT_CNT) {
-		imr_end(imr);
-		imr_begin(imr);
-	}
+	imr_reserve(imr, 3);
+	f32 slot = imr_texture_slot(imr, tex_id);
 
 	v3 centroid = {
 		(p1.x + p2.x + p3.x) / 3.0f,
@@ -1924,13 +3622,1241 @@ void imr_push_triangle_tex(IMR* imr, v3 p1, v3 p2, v3 p3, Triangle tex_coord, f3
 	a3.tex_coord = (v2) { tex_coord.c.x, tex_coord.c.y };
 
 	a1.color = a2.color = a3.color = color;
-	a1.tex_id = a2.tex_id = a3.tex_id = tex_id;
+	a1.tex_id = a2.tex_id = a3.tex_id = slot;
+	a1.overlay_color = a2.overlay_color = a3.overlay_color = (v4) {0};
+	a1.palette = a2.palette = a3.palette = PALETTE_NONE;
 
 	imr_push_vertex(imr, a1);
 	imr_push_vertex(imr, a2);
 	imr_push_vertex(imr, a3);
 }
 
+// :imr capture impl
+IMR_Capture* imr_capture_new(const char* filepath, u32 width, u32 height) {
+	FILE* file = fopen(filepath, "wb");
+	panic(file, "Failed to open capture file: %s\n", filepath);
+
+	IMR_Capture_Header header = {
+		.magic = IMR_CAPTURE_MAGIC,
+		.version = IMR_CAPTURE_VERSION,
+		.width = width,
+		.height = height,
+	};
+	fwrite(&header, sizeof(header), 1, file);
+
+	// Slots bound before the capture started
+	for (u32 i = 0; i < TEXTURE_SAMPLE_AMT; i++) {
+		if (!ctx->slots.textures[i]) continue;
+
+		u32 cmd[2] = { i, ctx->slots.textures[i] };
+		IMR_Capture_Record record = { IMR_CMD_BIND, sizeof(cmd) };
+		fwrite(&record, sizeof(record), 1, file);
+		fwrite(cmd, sizeof(cmd), 1, file);
+	}
+
+	IMR_Capture* cap = mem_alloc(sizeof(IMR_Capture));
+	cap->file = file;
+	cap->frames = 0;
+	return cap;
+}
+
+void imr_capture_delete(IMR_Capture* cap) {
+	if (ctx->capture == cap)
+		ctx->capture = NULL;
+
+	fclose(cap->file);
+	mem_free(cap);
+}
+
+void imr_capture_write(IMR_Capture* cap, IMR_CmdType type, const void* data, u32 size) {
+	IMR_Capture_Record record = { type, size };
+	fwrite(&record, sizeof(record), 1, cap->file);
+	if (size) fwrite(data, size, 1, cap->file);
+}
+
+void imr_capture_texture(IMR_Capture* cap, Texture texture) {
+	u32 size = 3 * sizeof(u32) + texture.width * texture.height * sizeof(u32);
+	u32* payload = mem_alloc(size);
+	payload[0] = texture.id;
+	payload[1] = texture.width;
+	payload[2] = texture.height;
+
+	// Reading back the pixels so that the replay doesnt need the assets
+	texture_bind(texture);
+	GLCall(glPixelStorei(GL_PACK_ALIGNMENT, 1));
+	GLCall(glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, payload + 3));
+
+	imr_capture_write(cap, IMR_CMD_TEXTURE, payload, size);
+	mem_free(payload);
+}
+
+void imr_capture_frame(IMR_Capture* cap) {
+	imr_capture_write(cap, IMR_CMD_FRAME, NULL, 0);
+	cap->frames++;
+}
+
+// :overdraw impl
+const char* __overdraw_count_f_src =
+	"#version 330 core\n"
+	"layout (location = 0) out vec4 color;\n"
+	"void main() {\n"
+	"color = vec4(1.0f / 255.0f, 0.0f, 0.0f, 1.0f);\n"
+	"}\n";
+
+const char* __overdraw_heat_f_src =
+	"#version 330 core\n"
+	"layout (location = 0) out vec4 color;\n"
+	"uniform sampler2D counts;\n"
+	"in vec2 o_tex_coord;\n"
+	"void main() {\n"
+	"float n = texture(counts, o_tex_coord).r * 255.0f;\n"
+	"vec3 heat = vec3(0.0f);\n"
+	"if      (n < 0.5f) heat = vec3(0.0f, 0.0f, 0.0f);\n"
+	"else if (n < 1.5f) heat = vec3(0.0f, 0.0f, 1.0f);\n"
+	"else if (n < 2.5f) heat = vec3(0.0f, 1.0f, 0.0f);\n"
+	"else if (n < 3.5f) heat = vec3(1.0f, 1.0f, 0.0f);\n"
+	"else if (n < 7.5f) heat = vec3(1.0f, 0.0f, 0.0f);\n"
+	"else               heat = vec3(1.0f, 1.0f, 1.0f);\n"
+	"color = vec4(heat, 1.0f);\n"
+	"}\n";
+
+Overdraw overdraw_new(u32 width, u32 height) {
+	return (Overdraw) {
+		.fbo = fbo_new(width, height),
+		.count_shader = shader_new(__internal_v_src, __overdraw_count_f_src),
+		.heat_shader = shader_new(__internal_v_src, __overdraw_heat_f_src),
+		.counts = mem_alloc(width * height),
+		.avg = 0.0f,
+		.max = 0,
+	};
+}
+
+void overdraw_delete(Overdraw* od) {
+	fbo_delete(&od->fbo);
+	shader_delete(od->count_shader);
+	shader_delete(od->heat_shader);
+	mem_free(od->counts);
+}
+
+void overdraw_begin(Overdraw* od, IMR* imr) {
+	fbo_bind(&od->fbo);
+	imr_clear((v4) { 0, 0, 0, 0 });
+
+	// Every fragment adds 1 / 255 to the red channel
+	imr_blend(GL_ONE, GL_ONE);
+	imr_switch_shader(imr, od->count_shader);
+	imr_update_mvp(imr, imr->mvp);
+}
+
+void overdraw_end(Overdraw* od, IMR* imr) {
+	u32 width = od->fbo.color_texture.width;
+	u32 height = od->fbo.color_texture.height;
+
+	// NOTE: This stalls the pipeline, which is fine for a debug mode
+	GLCall(glPixelStorei(GL_PACK_ALIGNMENT, 1));
+	GLCall(glReadPixels(0, 0, width, height, GL_RED, GL_UNSIGNED_BYTE, od->counts));
+
+	u64 total = 0;
+	od->max = 0;
+	for (u32 i = 0; i < width * height; i++) {
+		total += od->counts[i];
+		if (od->counts[i] > od->max) od->max = od->counts[i];
+	}
+	od->avg = (f32) total / (width * height);
+
+	fbo_unbind();
+	imr_blend(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	imr_switch_shader_to_default(imr);
+	imr_update_mvp(imr, imr->mvp);
+}
+
+void overdraw_present(Overdraw* od, IMR* imr) {
+	Texture counts = od->fbo.color_texture;
+	m4 mvp = imr->mvp;
+
+	imr_switch_shader(imr, od->heat_shader);
+	imr_update_mvp(imr, ortho_screen_mvp(counts.width, counts.height));
+
+	imr_begin(imr);
+	i32 loc = GLCall(glGetUniformLocation(od->heat_shader, "counts"));
+	GLCall(glUniform1i(loc, imr_texture_slot(imr, counts.id)));
+	imr_push_quad_tex(
+		imr,
+		(v3) { 0, 0, 0 },
+		(v2) { counts.width, counts.height },
+		(Rect) { 0, 1, 1, -1 }, // Fbo textures are upside down
+		counts.id,
+		rotate_x(0),
+		(v4) { 1, 1, 1, 1 }
+	);
+	imr_end(imr);
+
+	imr_switch_shader_to_default(imr);
+	imr_update_mvp(imr, mvp);
+}
+
+// :lighting impl
+Lighting lighting_new(u32 width, u32 height, v4 ambient) {
+	// Bilinear filtering for upsampling the light buffer
+	FBO fbo = fbo_new_ex(width / LIGHT_DOWNSCALE, height / LIGHT_DOWNSCALE, TEXTURE_OPTIONS_LINEAR);
+
+	// Radial falloff used by every light sprite
+	u32 pixels[LIGHT_FALLOFF_SIZE * LIGHT_FALLOFF_SIZE];
+	f32 half = LIGHT_FALLOFF_SIZE / 2.0f;
+	for (u32 y = 0; y < LIGHT_FALLOFF_SIZE; y++) {
+		for (u32 x = 0; x < LIGHT_FALLOFF_SIZE; x++) {
+			f32 d = v2_mag((v2) { x + 0.5f - half, y + 0.5f - half }) / half;
+			f32 a = d < 1.0f ? (1.0f - d) * (1.0f - d) : 0.0f;
+			pixels[y * LIGHT_FALLOFF_SIZE + x] = ((u32) (a * 255.0f) << 24) | 0x00ffffff;
+		}
+	}
+	// Flashes shrink down to nothing so it is minified a lot, the gradient is smooth
+	// enough that block compression doesnt show
+	Texture falloff = texture_from_data_ex(
+		LIGHT_FALLOFF_SIZE, LIGHT_FALLOFF_SIZE, pixels,
+		(TextureOptions) { GL_LINEAR_MIPMAP_LINEAR, GL_LINEAR, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, true, true }
+	);
+
+	return (Lighting) {
+		.fbo = fbo,
+		.falloff = falloff,
+		.ambient = ambient,
+	};
+}
+
+void lighting_delete(Lighting* lighting) {
+	fbo_delete(&lighting->fbo);
+	texture_delete(lighting->falloff);
+}
+
+void lighting_begin(Lighting* lighting, IMR* imr) {
+	fbo_bind(&lighting->fbo);
+	imr_clear((v4) {
+		lighting->ambient.r * 0.5f,
+		lighting->ambient.g * 0.5f,
+		lighting->ambient.b * 0.5f,
+		1.0f
+	});
+
+	// Lights add up
+	imr_blend(GL_SRC_ALPHA, GL_ONE);
+	imr_begin(imr);
+}
+
+void lighting_push(Lighting* lighting, IMR* imr, v2 pos, f32 radius, v4 color) {
+	imr_push_quad_tex(
+		imr,
+		(v3) { pos.x - radius, pos.y - radius, 0 },
+		(v2) { radius * 2, radius * 2 },
+		(Rect) { 0, 0, 1, 1 },
+		lighting->falloff.id,
+		rotate_x(0),
+		(v4) { color.r * 0.5f, color.g * 0.5f, color.b * 0.5f, color.a }
+	);
+}
+
+void lighting_end(Lighting* lighting, IMR* imr) {
+	imr_end(imr);
+	fbo_unbind();
+	imr_blend(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+}
+
+void lighting_composite(Lighting* lighting, IMR* imr) {
+	Texture light = lighting->fbo.color_texture;
+	m4 mvp = imr->mvp;
+
+	// scene * light * 2
+	imr_blend(GL_DST_COLOR, GL_SRC_COLOR);
+
+	// A unit quad in a unit projection covers whatever target is bound
+	imr_update_mvp(imr, ortho_screen_mvp(1, 1));
+	imr_begin(imr);
+	imr_push_quad_tex(
+		imr,
+		(v3) { 0, 0, 0 },
+		(v2) { 1, 1 },
+		(Rect) { 0, 1, 1, -1 }, // Fbo textures are upside down
+		light.id,
+		rotate_x(0),
+		(v4) { 1, 1, 1, 1 }
+	);
+	imr_end(imr);
+
+	imr_blend(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	imr_update_mvp(imr, mvp);
+}
+
+// :render scale impl
+RenderScale render_scale_new(u32 width, u32 height, f64 target_ms) {
+	RenderScale rs = {
+		// Bilinear filtering for upscaling
+		.fbo = fbo_new_ex(width, height, TEXTURE_OPTIONS_LINEAR),
+		.scale = 1.0f,
+		.target_ms = target_ms,
+	};
+
+	GLCall(glGenQueries(RENDER_SCALE_QUERIES, rs.queries));
+	return rs;
+}
+
+void render_scale_delete(RenderScale* rs) {
+	if (rs->querying) GLCall(glEndQuery(GL_TIME_ELAPSED));
+	GLCall(glDeleteQueries(RENDER_SCALE_QUERIES, rs->queries));
+	fbo_delete(&rs->fbo);
+}
+
+void render_scale_begin(RenderScale* rs) {
+	// Skip timing this frame if the gpu is still behind on the oldest query
+	rs->querying = !rs->pending[rs->query_idx];
+	if (rs->querying) {
+		GLCall(glBeginQuery(GL_TIME_ELAPSED, rs->queries[rs->query_idx]));
+		rs->epochs[rs->query_idx] = rs->epoch;
+	}
+
+	Texture tex = rs->fbo.color_texture;
+	fbo_bind_region(&rs->fbo, tex.width * rs->scale, tex.height * rs->scale);
+}
+
+void render_scale_end() {
+	fbo_unbind();
+}
+
+void render_scale_present(RenderScale* rs, IMR* imr) {
+	Texture tex = rs->fbo.color_texture;
+	f32 u = (u32) (tex.width * rs->scale) / (f32) tex.width;
+	f32 v = (u32) (tex.height * rs->scale) / (f32) tex.height;
+	m4 mvp = imr->mvp;
+
+	// Overwriting the target, no need to blend
+	imr_blend(GL_ONE, GL_ZERO);
+	imr_update_mvp(imr, ortho_screen_mvp(1, 1));
+	imr_begin(imr);
+	imr_push_quad_tex(
+		imr,
+		(v3) { 0, 0, 0 },
+		(v2) { 1, 1 },
+		(Rect) { 0, v, u, -v }, // Fbo textures are upside down
+		tex.id,
+		rotate_x(0),
+		(v4) { 1, 1, 1, 1 }
+	);
+	imr_end(imr);
+
+	imr_blend(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	imr_update_mvp(imr, mvp);
+}
+
+void render_scale_update(RenderScale* rs) {
+	if (rs->querying) {
+		GLCall(glEndQuery(GL_TIME_ELAPSED));
+		rs->pending[rs->query_idx] = true;
+		rs->query_idx = (rs->query_idx + 1) % RENDER_SCALE_QUERIES;
+		rs->querying = false;
+	}
+
+	// Reading every finished query from the oldest to the newest
+	for (u32 i = 0; i < RENDER_SCALE_QUERIES; i++) {
+		u32 idx = (rs->query_idx + i) % RENDER_SCALE_QUERIES;
+		if (!rs->pending[idx]) continue;
+
+		i32 available = 0;
+		GLCall(glGetQueryObjectiv(rs->queries[idx], GL_QUERY_RESULT_AVAILABLE, &available));
+		if (!available) break;
+
+		GLuint64 elapsed = 0;
+		GLCall(glGetQueryObjectui64v(rs->queries[idx], GL_QUERY_RESULT, &elapsed));
+		rs->pending[idx] = false;
+		if (rs->epochs[idx] != rs->epoch) continue;
+		rs->gpu_ms = elapsed / 1000000.0;
+
+		// Hysteresis
+		if (rs->gpu_ms > rs->target_ms) {
+			rs->over_frames++;
+			rs->under_frames = 0;
+		} else if (rs->gpu_ms < rs->target_ms * RENDER_SCALE_HEADROOM) {
+			rs->under_frames++;
+			rs->over_frames = 0;
+		} else {
+			rs->over_frames = rs->under_frames = 0;
+		}
+
+		f32 prev = rs->scale;
+		if (rs->over_frames >= RENDER_SCALE_DOWN_FRAMES) {
+			rs->scale -= RENDER_SCALE_STEP;
+			rs->over_frames = 0;
+		}
+		if (rs->under_frames >= RENDER_SCALE_UP_FRAMES) {
+			rs->scale += RENDER_SCALE_STEP;
+			rs->under_frames = 0;
+		}
+		if (rs->scale < RENDER_SCALE_MIN) rs->scale = RENDER_SCALE_MIN;
+		if (rs->scale > 1.0f) rs->scale = 1.0f;
+
+		if (rs->scale != prev) {
+			rs->epoch++;
+			log_info("Render scale: %.2f (gpu %.2f ms)\n", rs->scale, rs->gpu_ms);
+		}
+	}
+}
+
+// :ui layer impl
+UILayer ui_layer_new(Rect rect, v2 screen) {
+	return (UILayer) {
+		.fbo = fbo_new(rect.w, rect.h),
+		.rect = rect,
+		.screen = screen,
+		.dirty = true,
+	};
+}
+
+void ui_layer_delete(UILayer* ui) {
+	fbo_delete(&ui->fbo);
+}
+
+void ui_layer_begin(UILayer* ui) {
+	ui->prev_inputs_cnt = ui->inputs_cnt;
+	ui->inputs_cnt = 0;
+}
+
+void ui_layer_input(UILayer* ui, i32 value) {
+	panic(ui->inputs_cnt < UI_MAX_INPUTS, "Too many ui inputs\n");
+
+	if (ui->inputs[ui->inputs_cnt] != value) ui->dirty = true;
+	ui->inputs[ui->inputs_cnt++] = value;
+}
+
+void ui_layer_invalidate(UILayer* ui) {
+	ui->dirty = true;
+}
+
+b32 ui_layer_redraw_begin(UILayer* ui, IMR* imr) {
+	if (ui->inputs_cnt != ui->prev_inputs_cnt) ui->dirty = true;
+	if (!ui->dirty) return false;
+
+	fbo_bind(&ui->fbo);
+	imr_clear((v4) { 0, 0, 0, 0 });
+
+	// The rect of the screen is mapped over the whole cache
+	Rect r = ui->rect;
+	ui->prev_mvp = imr->mvp;
+	imr_update_mvp(imr, m4_transpose(ortho_projection(r.x, r.x + r.w, r.y, r.y + r.h, -1.0f, 1.0f)));
+
+	// Keeping the alpha of the widgets so the cache can be composited premultiplied
+	imr_blend_separate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	imr_begin(imr);
+	return true;
+}
+
+void ui_layer_redraw_end(UILayer* ui, IMR* imr) {
+	imr_end(imr);
+	fbo_unbind();
+	imr_blend(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	imr_update_mvp(imr, ui->prev_mvp);
+	ui->dirty = false;
+}
+
+void ui_layer_present(UILayer* ui, IMR* imr) {
+	Texture tex = ui->fbo.color_texture;
+	m4 mvp = imr->mvp;
+
+	// Only the rect of the layer is composited
+	imr_blend(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	imr_update_mvp(imr, ortho_screen_mvp(ui->screen.x, ui->screen.y));
+	imr_begin(imr);
+	imr_push_quad_tex(
+		imr,
+		(v3) { ui->rect.x, ui->rect.y, 0 },
+		(v2) { ui->rect.w, ui->rect.h },
+		(Rect) { 0, 1, 1, -1 }, // Fbo textures are upside down
+		tex.id,
+		rotate_x(0),
+		(v4) { 1, 1, 1, 1 }
+	);
+	imr_end(imr);
+
+	imr_blend(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	imr_update_mvp(imr, mvp);
+}
+
+// :parallax impl
+Parallax parallax_new() {
+	return (Parallax) {0};
+}
+
+void parallax_delete(Parallax* p) {
+	for (u32 i = 0; i < p->layers_cnt; i++)
+		fbo_delete(&p->layers[i].fbo);
+	p->layers_cnt = 0;
+}
+
+u32 parallax_add_layer(Parallax* p, u32 width, u32 height, f32 factor, ParallaxComposeFn compose, void* data) {
+	panic(p->layers_cnt < MAX_PARALLAX_LAYERS, "Too many parallax layers\n");
+
+	p->layers[p->layers_cnt] = (ParallaxLayer) {
+		.fbo = fbo_new_ex(width, height, (TextureOptions) { GL_NEAREST, GL_NEAREST, GL_REPEAT, GL_CLAMP_TO_EDGE, false, false }),
+		.factor = factor,
+		.compose = compose,
+		.data = data,
+		.dirty = true,
+	};
+	return p->layers_cnt++;
+}
+
+void parallax_invalidate(Parallax* p, u32 layer) {
+	p->layers[layer].dirty = true;
+}
+
+void parallax_update(Parallax* p, IMR* imr) {
+	m4 mvp = imr->mvp;
+	b32 composed = false;
+
+	for (u32 i = 0; i < p->layers_cnt; i++) {
+		ParallaxLayer* layer = &p->layers[i];
+		if (!layer->dirty) continue;
+
+		Texture tex = layer->fbo.color_texture;
+		fbo_bind(&layer->fbo);
+		imr_clear((v4) { 0, 0, 0, 0 });
+		imr_update_mvp(imr, ortho_screen_mvp(tex.width, tex.height));
+
+		imr_begin(imr);
+		layer->compose(imr, tex.width, tex.height, layer->data);
+		imr_end(imr);
+
+		fbo_unbind();
+		layer->dirty = false;
+		composed = true;
+	}
+
+	if (composed) imr_update_mvp(imr, mvp);
+}
+
+void parallax_draw(Parallax* p, IMR* imr, v2 cam_pos, v2 view_size) {
+	if (!p->layers_cnt) return;
+	m4 mvp = imr->mvp;
+
+	// A unit quad in a unit projection covers whatever target is bound
+	imr_update_mvp(imr, ortho_screen_mvp(1, 1));
+	imr_begin(imr);
+	for (u32 i = 0; i < p->layers_cnt; i++) {
+		ParallaxLayer* layer = &p->layers[i];
+		Texture tex = layer->fbo.color_texture;
+
+		// Scrolling in pixels, the texture repeats past its sides
+		v2 scroll = dgl_to_dp_coords(cam_pos, view_size.x, view_size.y);
+		f32 u = scroll.x * layer->factor / tex.width;
+
+		imr_push_quad_tex(
+			imr,
+			(v3) { 0, 0, 0 },
+			(v2) { 1, 1 },
+			(Rect) { u, 1, view_size.x / tex.width, -view_size.y / tex.height }, // Fbo textures are upside down
+			tex.id,
+			rotate_x(0),
+			(v4) { 1, 1, 1, 1 }
+		);
+	}
+	imr_end(imr);
+
+	imr_update_mvp(imr, mvp);
+}
+
+// :tilemap impl
+static TileChunk* tilemap_chunk(Tilemap* map, i32 x, i32 y) {
+	return map->chunks[(y / TILEMAP_CHUNK_SIZE) * map->chunks_w + x / TILEMAP_CHUNK_SIZE];
+}
+
+Tilemap tilemap_new(u32 width, u32 height, f32 tile_size) {
+	panic(width && height, "Invalid tilemap size\n");
+
+	u32 chunks_w = (width + TILEMAP_CHUNK_SIZE - 1) / TILEMAP_CHUNK_SIZE;
+	u32 chunks_h = (height + TILEMAP_CHUNK_SIZE - 1) / TILEMAP_CHUNK_SIZE;
+	TileChunk** chunks = mem_alloc(chunks_w * chunks_h * sizeof(TileChunk*));
+	memset(chunks, 0, chunks_w * chunks_h * sizeof(TileChunk*));
+
+	Tilemap map = {
+		.width = width,
+		.height = height,
+		.chunks_w = chunks_w,
+		.chunks_h = chunks_h,
+		.tile_size = tile_size,
+		.chunks = chunks,
+		.rects_dirty = true,
+	};
+	for (u32 i = 0; i < TILEMAP_MAX_KINDS; i++)
+		map.colors[i] = (v4) { 1, 1, 1, 1 };
+	return map;
+}
+
+void tilemap_delete(Tilemap* map) {
+	for (u32 cy = 0; cy < map->chunks_h; cy++) {
+		for (u32 cx = 0; cx < map->chunks_w; cx++)
+			tilemap_chunk_unload(map, cx, cy);
+	}
+	mem_free(map->chunks);
+	if (map->rects) mem_free(map->rects);
+}
+
+void tilemap_set_color(Tilemap* map, Tile tile, v4 color) {
+	panic(tile < TILEMAP_MAX_KINDS, "Invalid tile: %d\n", tile);
+	map->colors[tile] = color;
+
+	for (u32 i = 0; i < map->chunks_w * map->chunks_h; i++) {
+		if (map->chunks[i]) map->chunks[i]->dirty = true;
+	}
+}
+
+Tile tilemap_get(Tilemap* map, i32 x, i32 y) {
+	if (x < 0 || y < 0 || x >= (i32) map->width || y >= (i32) map->height)
+		return TILE_EMPTY;
+
+	TileChunk* chunk = tilemap_chunk(map, x, y);
+	if (!chunk) return TILE_EMPTY;
+	return chunk->tiles[(y % TILEMAP_CHUNK_SIZE) * TILEMAP_CHUNK_SIZE + x % TILEMAP_CHUNK_SIZE];
+}
+
+void tilemap_set(Tilemap* map, i32 x, i32 y, Tile tile) {
+	panic(tile < TILEMAP_MAX_KINDS, "Invalid tile: %d\n", tile);
+	if (x < 0 || y < 0 || x >= (i32) map->width || y >= (i32) map->height)
+		return;
+
+	TileChunk* chunk = tilemap_chunk(map, x, y);
+	if (!chunk) {
+		if (tile == TILE_EMPTY) return;
+		chunk = tilemap_chunk_load(map, x / TILEMAP_CHUNK_SIZE, y / TILEMAP_CHUNK_SIZE);
+	}
+
+	Tile* dst = &chunk->tiles[(y % TILEMAP_CHUNK_SIZE) * TILEMAP_CHUNK_SIZE + x % TILEMAP_CHUNK_SIZE];
+	if (*dst == tile) return;
+
+	*dst = tile;
+	chunk->dirty = true;
+	chunk->rects_dirty = true;
+	map->rects_dirty = true;
+}
+
+void tilemap_fill(Tilemap* map, i32 x, i32 y, i32 w, i32 h, Tile tile) {
+	for (i32 j = y; j < y + h; j++) {
+		for (i32 i = x; i < x + w; i++)
+			tilemap_set(map, i, j, tile);
+	}
+}
+
+b32 tilemap_pick(Tilemap* map, v2 world_pos, i32* x, i32* y) {
+	*x = floorf(world_pos.x / map->tile_size);
+	*y = floorf(world_pos.y / map->tile_size);
+	return *x >= 0 && *y >= 0 && *x < (i32) map->width && *y < (i32) map->height;
+}
+
+TileChunk* tilemap_chunk_load(Tilemap* map, u32 cx, u32 cy) {
+	panic(cx < map->chunks_w && cy < map->chunks_h, "Chunk out of bounds: %d %d\n", cx, cy);
+
+	TileChunk** slot = &map->chunks[cy * map->chunks_w + cx];
+	if (*slot) return *slot;
+
+	TileChunk* chunk = mem_alloc(sizeof(TileChunk));
+	memset(chunk, 0, sizeof(TileChunk));
+	chunk->dirty = true;
+	*slot = chunk;
+
+	map->rects_dirty = true;
+	return chunk;
+}
+
+void tilemap_chunk_unload(Tilemap* map, u32 cx, u32 cy) {
+	TileChunk** slot = &map->chunks[cy * map->chunks_w + cx];
+	TileChunk* chunk = *slot;
+	if (!chunk) return;
+
+	if (chunk->vao) {
+		GLCall(glDeleteVertexArrays(1, &chunk->vao));
+		GLCall(glDeleteBuffers(1, &chunk->vbo));
+	}
+	if (chunk->mesh) mem_free(chunk->mesh);
+	mem_free(chunk);
+	*slot = NULL;
+
+	map->rects_dirty = true;
+}
+
+u32 tilemap_merge_rects(Tilemap* map, TileChunk* chunk, u32 cx, u32 cy, Rect* rects) {
+	// Greedy merging, every rect grows as far right as it can and then down by whole rows
+	u8 used[TILEMAP_CHUNK_TILES] = {0};
+	u32 rects_cnt = 0;
+
+	for (u32 y = 0; y < TILEMAP_CHUNK_SIZE; y++) {
+		for (u32 x = 0; x < TILEMAP_CHUNK_SIZE; x++) {
+			u32 i = y * TILEMAP_CHUNK_SIZE + x;
+			if (used[i] || chunk->tiles[i] == TILE_EMPTY)
+				continue;
+
+			u32 w = 1;
+			while (x + w < TILEMAP_CHUNK_SIZE && !used[i + w] && chunk->tiles[i + w] != TILE_EMPTY)
+				w++;
+
+			u32 h = 1;
+			for (b32 grow = true; grow && y + h < TILEMAP_CHUNK_SIZE; ) {
+				u32 row = (y + h) * TILEMAP_CHUNK_SIZE;
+				for (u32 j = x; j < x + w && grow; j++)
+					grow = !used[row + j] && chunk->tiles[row + j] != TILE_EMPTY;
+				if (grow) h++;
+			}
+
+			for (u32 j = y; j < y + h; j++)
+				memset(&used[j * TILEMAP_CHUNK_SIZE + x], 1, w);
+
+			rects[rects_cnt++] = (Rect) {
+				(cx * TILEMAP_CHUNK_SIZE + x) * map->tile_size,
+				(cy * TILEMAP_CHUNK_SIZE + y) * map->tile_size,
+				w * map->tile_size,
+				h * map->tile_size
+			};
+		}
+	}
+
+	return rects_cnt;
+}
+
+Rect* tilemap_rects(Tilemap* map, i32* rects_cnt) {
+	if (!map->rects_dirty) {
+		*rects_cnt = map->rects_cnt;
+		return map->rects;
+	}
+
+	// Gathering the rects of every resident chunk, only edited chunks are merged again
+	map->rects_cnt = 0;
+	for (u32 cy = 0; cy < map->chunks_h; cy++) {
+		for (u32 cx = 0; cx < map->chunks_w; cx++) {
+			TileChunk* chunk = map->chunks[cy * map->chunks_w + cx];
+			if (!chunk) continue;
+
+			if (chunk->rects_dirty) {
+				chunk->rects_cnt = tilemap_merge_rects(map, chunk, cx, cy, chunk->rects);
+				chunk->rects_dirty = false;
+			}
+
+			if (map->rects_cnt + chunk->rects_cnt > map->rects_cap) {
+				u32 cap = map->rects_cap ? map->rects_cap : 16;
+				while (cap < map->rects_cnt + chunk->rects_cnt) cap *= 2;
+
+				if (map->rects) {
+					map->rects = mem_realloc(map->rects, cap * sizeof(Rect));
+				} else {
+					map->rects = mem_alloc(cap * sizeof(Rect));
+				}
+				map->rects_cap = cap;
+			}
+			memcpy(&map->rects[map->rects_cnt], chunk->rects, chunk->rects_cnt * sizeof(Rect));
+			map->rects_cnt += chunk->rects_cnt;
+		}
+	}
+
+	map->rects_dirty = false;
+	*rects_cnt = map->rects_cnt;
+	return map->rects;
+}
+
+static void tilemap_build_chunk(Tilemap* map, TileChunk* chunk, u32 cx, u32 cy) {
+	// Counting first so that the mesh is sized once
+	u32 tiles = 0;
+	for (u32 i = 0; i < TILEMAP_CHUNK_TILES; i++)
+		tiles += chunk->tiles[i] != TILE_EMPTY;
+
+	u32 verts = tiles * 6;
+	if (!chunk->vao) {
+		GLCall(glGenVertexArrays(1, &chunk->vao));
+		GLCall(glBindVertexArray(chunk->vao));
+		GLCall(glGenBuffers(1, &chunk->vbo));
+		GLCall(glBindBuffer(GL_ARRAY_BUFFER, chunk->vbo));
+		imr_vertex_format();
+	}
+	if (verts > chunk->vbo_cap) {
+		if (chunk->mesh) {
+			chunk->mesh = mem_realloc(chunk->mesh, verts * sizeof(Vertex));
+		} else {
+			chunk->mesh = mem_alloc(verts * sizeof(Vertex));
+		}
+	}
+
+	Vertex* v = (Vertex*) chunk->mesh;
+	for (u32 ty = 0; ty < TILEMAP_CHUNK_SIZE; ty++) {
+		for (u32 tx = 0; tx < TILEMAP_CHUNK_SIZE; tx++) {
+			Tile tile = chunk->tiles[ty * TILEMAP_CHUNK_SIZE + tx];
+			if (tile == TILE_EMPTY) continue;
+
+			f32 x0 = (cx * TILEMAP_CHUNK_SIZE + tx) * map->tile_size;
+			f32 y0 = (cy * TILEMAP_CHUNK_SIZE + ty) * map->tile_size;
+			f32 x1 = x0 + map->tile_size;
+			f32 y1 = y0 + map->tile_size;
+			v2 corners[6] = { {x0, y0}, {x1, y0}, {x1, y1}, {x0, y0}, {x1, y1}, {x0, y1} };
+
+			for (u32 i = 0; i < 6; i++) {
+				*v++ = (Vertex) {
+					.pos = { corners[i].x, corners[i].y, 0 },
+					.color = map->colors[tile],
+					.tex_coord = { 0, 0 },
+					.tex_id = 0, // White
+					.overlay_color = { 0, 0, 0, 0 },
+					.palette = PALETTE_NONE,
+				};
+			}
+		}
+	}
+
+	GLCall(glBindBuffer(GL_ARRAY_BUFFER, chunk->vbo));
+	if (verts > chunk->vbo_cap) {
+		GLCall(glBufferData(GL_ARRAY_BUFFER, verts * sizeof(Vertex), chunk->mesh, GL_STATIC_DRAW));
+		chunk->vbo_cap = verts;
+	} else if (verts) {
+		GLCall(glBufferSubData(GL_ARRAY_BUFFER, 0, verts * sizeof(Vertex), chunk->mesh));
+	}
+
+	chunk->verts = verts;
+	chunk->dirty = false;
+}
+
+void tilemap_draw(Tilemap* map, IMR* imr, Rect view) {
+	f32 chunk_px = TILEMAP_CHUNK_SIZE * map->tile_size;
+	i32 x0 = floorf(view.x / chunk_px);
+	i32 y0 = floorf(view.y / chunk_px);
+	i32 x1 = floorf((view.x + view.w) / chunk_px);
+	i32 y1 = floorf((view.y + view.h) / chunk_px);
+
+	if (x0 < 0) x0 = 0;
+	if (y0 < 0) y0 = 0;
+	if (x1 >= (i32) map->chunks_w) x1 = map->chunks_w - 1;
+	if (y1 >= (i32) map->chunks_h) y1 = map->chunks_h - 1;
+
+	for (i32 cy = y0; cy <= y1; cy++) {
+		for (i32 cx = x0; cx <= x1; cx++) {
+			TileChunk* chunk = map->chunks[cy * map->chunks_w + cx];
+			if (!chunk) continue;
+
+			if (chunk->dirty)
+				tilemap_build_chunk(map, chunk, cx, cy);
+			if (!chunk->verts) continue;
+
+			// Chunks are static so a capture sees them as regular batches
+			if (ctx && ctx->capture)
+				imr_capture_write(ctx->capture, IMR_CMD_DRAW, chunk->mesh, chunk->verts * sizeof(Vertex));
+
+			imr_draw_arrays(imr, chunk->vao, chunk->verts);
+		}
+	}
+}
+
+// :level impl
+static u64 level_chunk_size(LevelChunkEntry* entry) {
+	return TILEMAP_CHUNK_TILES + entry->rects_cnt * sizeof(Rect) + entry->spawns_cnt * sizeof(LevelSpawn);
+}
+
+static u32 level_spawn_chunk(Tilemap* map, v2 pos) {
+	f32 chunk_px = TILEMAP_CHUNK_SIZE * map->tile_size;
+	i32 cx = floorf(pos.x / chunk_px);
+	i32 cy = floorf(pos.y / chunk_px);
+	cx = cx < 0 ? 0 : (cx >= (i32) map->chunks_w ? (i32) map->chunks_w - 1 : cx);
+	cy = cy < 0 ? 0 : (cy >= (i32) map->chunks_h ? (i32) map->chunks_h - 1 : cy);
+	return cy * map->chunks_w + cx;
+}
+
+b32 level_save(Tilemap* map, LevelSpawn* spawns, u32 spawns_cnt, const char* path) {
+	FILE* file = fopen(path, "wb");
+	if (!file) {
+		log_warn("Failed to open level for writing: %s\n", path);
+		return false;
+	}
+
+	u32 chunks_cnt = map->chunks_w * map->chunks_h;
+	LevelHeader header = {
+		.magic = LEVEL_MAGIC,
+		.version = LEVEL_VERSION,
+		.width = map->width,
+		.height = map->height,
+		.chunks_w = map->chunks_w,
+		.chunks_h = map->chunks_h,
+		.chunk_size = TILEMAP_CHUNK_SIZE,
+		.tile_size = map->tile_size,
+	};
+
+	LevelChunkEntry* index = mem_alloc(chunks_cnt * sizeof(LevelChunkEntry));
+	memset(index, 0, chunks_cnt * sizeof(LevelChunkEntry));
+	for (u32 i = 0; i < spawns_cnt; i++)
+		index[level_spawn_chunk(map, spawns[i].pos)].spawns_cnt++;
+
+	// Chunk data goes after the index, empty chunks without spawns are left out
+	u64 offset = sizeof(LevelHeader) + chunks_cnt * sizeof(LevelChunkEntry);
+	fseek(file, offset, SEEK_SET);
+
+	TileChunk empty = {0};
+	for (u32 c = 0; c < chunks_cnt; c++) {
+		TileChunk* chunk = map->chunks[c] ? map->chunks[c] : &empty;
+		LevelChunkEntry* entry = &index[c];
+		if (chunk == &empty && !entry->spawns_cnt) continue;
+
+		Rect rects[TILEMAP_CHUNK_RECTS];
+		entry->rects_cnt = tilemap_merge_rects(map, chunk, c % map->chunks_w, c / map->chunks_w, rects);
+		entry->offset = offset;
+
+		fwrite(chunk->tiles, sizeof(Tile), TILEMAP_CHUNK_TILES, file);
+		fwrite(rects, sizeof(Rect), entry->rects_cnt, file);
+		for (u32 i = 0; i < spawns_cnt; i++) {
+			if (level_spawn_chunk(map, spawns[i].pos) == c)
+				fwrite(&spawns[i], sizeof(LevelSpawn), 1, file);
+		}
+		offset += level_chunk_size(entry);
+	}
+
+	fseek(file, 0, SEEK_SET);
+	fwrite(&header, sizeof(header), 1, file);
+	fwrite(index, sizeof(LevelChunkEntry), chunks_cnt, file);
+	b32 ok = !ferror(file);
+	fclose(file);
+	mem_free(index);
+
+	if (!ok) log_warn("Failed to write level: %s\n", path);
+	return ok;
+}
+
+static b32 level_window_contains(LevelWindow w, i32 cx, i32 cy) {
+	return cx >= w.x0 && cx <= w.x1 && cy >= w.y0 && cy <= w.y1;
+}
+
+static b32 level_windows_contain(LevelWindow* windows, u32 windows_cnt, i32 cx, i32 cy) {
+	for (u32 i = 0; i < windows_cnt; i++) {
+		if (level_window_contains(windows[i], cx, cy)) return true;
+	}
+	return false;
+}
+
+static void* level_prefetch(void* arg) {
+	LevelStream* stream = arg;
+	u64 page = sysconf(_SC_PAGESIZE);
+
+	pthread_mutex_lock(&stream->lock);
+	while (stream->running) {
+		if (!stream->prefetch_pending) {
+			pthread_cond_wait(&stream->cond, &stream->lock);
+			continue;
+		}
+		LevelWindow windows[LEVEL_STREAM_VIEWS];
+		u32 windows_cnt = stream->prefetch_cnt;
+		memcpy(windows, stream->prefetch, windows_cnt * sizeof(LevelWindow));
+		stream->prefetch_pending = false;
+		pthread_mutex_unlock(&stream->lock);
+
+		// The hint starts the reads, touching a byte per page waits for them here
+		// instead of on the main thread
+		volatile u8 sink = 0;
+		for (u32 i = 0; i < windows_cnt; i++) {
+			LevelWindow window = windows[i];
+			for (i32 cy = window.y0; cy <= window.y1; cy++) {
+				for (i32 cx = window.x0; cx <= window.x1; cx++) {
+					// Where windows overlap the chunk was already touched
+					if (level_windows_contain(windows, i, cx, cy)) continue;
+
+					LevelChunkEntry* entry = &stream->index[cy * stream->header->chunks_w + cx];
+					if (!entry->offset) continue;
+
+					u64 start = entry->offset & ~(page - 1);
+					u64 end = entry->offset + level_chunk_size(entry);
+					madvise(stream->data + start, end - start, MADV_WILLNEED);
+					for (u64 p = start; p < end; p += page)
+						sink += stream->data[p];
+				}
+			}
+		}
+
+		pthread_mutex_lock(&stream->lock);
+	}
+	pthread_mutex_unlock(&stream->lock);
+	return NULL;
+}
+
+LevelStream* level_stream_open(const char* path, Tilemap* map, u32 radius) {
+	i32 fd = open(path, O_RDONLY);
+	panic(fd != -1, "Failed to open level: %s\n", path);
+
+	struct stat st;
+	panic(fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(LevelHeader), "Level is empty: %s\n", path);
+
+	u8* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	panic(data != MAP_FAILED, "Failed to map level: %s\n", path);
+
+	LevelHeader* header = (LevelHeader*) data;
+	panic(header->magic == LEVEL_MAGIC, "Not a level: %s\n", path);
+	panic(header->version == LEVEL_VERSION, "Unsupported level version: %d\n", header->version);
+	panic(header->chunk_size == TILEMAP_CHUNK_SIZE, "Level chunk size %d doesnt match %d\n", header->chunk_size, TILEMAP_CHUNK_SIZE);
+
+	*map = tilemap_new(header->width, header->height, header->tile_size);
+	panic(map->chunks_w == header->chunks_w && map->chunks_h == header->chunks_h, "Corrupted level header\n");
+
+	u32 chunks_cnt = header->chunks_w * header->chunks_h;
+	LevelChunkEntry* index = (LevelChunkEntry*) (header + 1);
+	panic(sizeof(LevelHeader) + chunks_cnt * sizeof(LevelChunkEntry) <= (size_t) st.st_size, "Level index is truncated\n");
+
+	LevelStream* stream = mem_alloc(sizeof(LevelStream));
+	memset(stream, 0, sizeof(LevelStream));
+	stream->map = map;
+	stream->fd = fd;
+	stream->data = data;
+	stream->size = st.st_size;
+	stream->header = header;
+	stream->index = index;
+	stream->radius = radius;
+	stream->windows_cnt = 0;
+
+	// Gathering the spawns of every chunk, they are few compared to the tiles
+	for (u32 c = 0; c < chunks_cnt; c++) {
+		LevelChunkEntry* entry = &index[c];
+		if (!entry->offset) continue;
+
+		panic(
+			entry->rects_cnt <= TILEMAP_CHUNK_RECTS && entry->offset + level_chunk_size(entry) <= stream->size,
+			"Corrupted level chunk: %d %d\n", c % header->chunks_w, c / header->chunks_w
+		);
+		stream->spawns_cnt += entry->spawns_cnt;
+	}
+	stream->spawns = mem_alloc((stream->spawns_cnt + 1) * sizeof(LevelSpawn));
+	u32 spawns_cnt = 0;
+	for (u32 c = 0; c < chunks_cnt; c++) {
+		LevelChunkEntry* entry = &index[c];
+		if (!entry->offset || !entry->spawns_cnt) continue;
+
+		u8* spawns = data + entry->offset + TILEMAP_CHUNK_TILES + entry->rects_cnt * sizeof(Rect);
+		memcpy(stream->spawns + spawns_cnt, spawns, entry->spawns_cnt * sizeof(LevelSpawn));
+		spawns_cnt += entry->spawns_cnt;
+	}
+
+	// Chunks are read in no particular order
+	madvise(data, st.st_size, MADV_RANDOM);
+
+	stream->running = true;
+	pthread_mutex_init(&stream->lock, NULL);
+	pthread_cond_init(&stream->cond, NULL);
+	panic(pthread_create(&stream->thread, NULL, level_prefetch, stream) == 0, "Failed to start the level prefetch thread\n");
+
+	log_info("Streaming level %s: %dx%d tiles in %d chunks\n", path, header->width, header->height, chunks_cnt);
+	return stream;
+}
+
+void level_stream_close(LevelStream* stream) {
+	pthread_mutex_lock(&stream->lock);
+	stream->running = false;
+	pthread_cond_signal(&stream->cond);
+	pthread_mutex_unlock(&stream->lock);
+	pthread_join(stream->thread, NULL);
+
+	pthread_mutex_destroy(&stream->lock);
+	pthread_cond_destroy(&stream->cond);
+	munmap(stream->data, stream->size);
+	close(stream->fd);
+	mem_free(stream->spawns);
+	mem_free(stream);
+}
+
+static LevelWindow level_window_around(LevelStream* stream, Rect view, i32 radius) {
+	f32 chunk_px = TILEMAP_CHUNK_SIZE * stream->header->tile_size;
+	LevelWindow w = {
+		floorf(view.x / chunk_px) - radius,
+		floorf(view.y / chunk_px) - radius,
+		floorf((view.x + view.w) / chunk_px) + radius,
+		floorf((view.y + view.h) / chunk_px) + radius,
+	};
+
+	if (w.x0 < 0) w.x0 = 0;
+	if (w.y0 < 0) w.y0 = 0;
+	if (w.x1 >= (i32) stream->header->chunks_w) w.x1 = stream->header->chunks_w - 1;
+	if (w.y1 >= (i32) stream->header->chunks_h) w.y1 = stream->header->chunks_h - 1;
+	return w;
+}
+
+static void level_page_in(LevelStream* stream, i32 cx, i32 cy) {
+	u32 c = cy * stream->header->chunks_w + cx;
+	LevelChunkEntry* entry = &stream->index[c];
+	if (!entry->offset) return;
+
+	panic(
+		entry->rects_cnt <= TILEMAP_CHUNK_RECTS && entry->offset + level_chunk_size(entry) <= stream->size,
+		"Corrupted level chunk: %d %d\n", cx, cy
+	);
+
+	u8* data = stream->data + entry->offset;
+	TileChunk* chunk = tilemap_chunk_load(stream->map, cx, cy);
+	memcpy(chunk->tiles, data, TILEMAP_CHUNK_TILES);
+	data += TILEMAP_CHUNK_TILES;
+
+	// The rects were merged when saving
+	memcpy(chunk->rects, data, entry->rects_cnt * sizeof(Rect));
+	chunk->rects_cnt = entry->rects_cnt;
+	chunk->rects_dirty = false;
+}
+
+void level_stream_update(LevelStream* stream, Rect* views, u32 views_cnt) {
+	panic(views_cnt <= LEVEL_STREAM_VIEWS, "Too many views for the level stream: %d\n", views_cnt);
+
+	LevelWindow windows[LEVEL_STREAM_VIEWS];
+	for (u32 i = 0; i < views_cnt; i++)
+		windows[i] = level_window_around(stream, views[i], stream->radius);
+	if (views_cnt == stream->windows_cnt && !memcmp(windows, stream->windows, views_cnt * sizeof(LevelWindow)))
+		return;
+
+	// A chunk stays resident while any window is over it
+	LevelWindow* old = stream->windows;
+	u32 old_cnt = stream->windows_cnt;
+	for (u32 i = 0; i < old_cnt; i++) {
+		for (i32 cy = old[i].y0; cy <= old[i].y1; cy++) {
+			for (i32 cx = old[i].x0; cx <= old[i].x1; cx++) {
+				if (level_windows_contain(old, i, cx, cy)) continue;
+				if (!level_windows_contain(windows, views_cnt, cx, cy))
+					tilemap_chunk_unload(stream->map, cx, cy);
+			}
+		}
+	}
+	for (u32 i = 0; i < views_cnt; i++) {
+		for (i32 cy = windows[i].y0; cy <= windows[i].y1; cy++) {
+			for (i32 cx = windows[i].x0; cx <= windows[i].x1; cx++) {
+				if (level_windows_contain(windows, i, cx, cy)) continue;
+				if (!level_windows_contain(old, old_cnt, cx, cy))
+					level_page_in(stream, cx, cy);
+			}
+		}
+	}
+	memcpy(stream->windows, windows, views_cnt * sizeof(LevelWindow));
+	stream->windows_cnt = views_cnt;
+
+	// The ring past every window is what gets paged in next
+	pthread_mutex_lock(&stream->lock);
+	for (u32 i = 0; i < views_cnt; i++)
+		stream->prefetch[i] = level_window_around(stream, views[i], stream->radius + 1);
+	stream->prefetch_cnt = views_cnt;
+	stream->prefetch_pending = true;
+	pthread_cond_signal(&stream->cond);
+	pthread_mutex_unlock(&stream->lock);
+}
+
+b32 level_stream_covers(LevelStream* stream, Rect area) {
+	// Nothing is under an area outside of the level
+	LevelWindow under = level_window_around(stream, area, 0);
+	if (under.x1 < under.x0 || under.y1 < under.y0) return true;
+
+	// The area can straddle two windows, so it is checked chunk by chunk
+	for (i32 cy = under.y0; cy <= under.y1; cy++) {
+		for (i32 cx = under.x0; cx <= under.x1; cx++) {
+			if (!level_windows_contain(stream->windows, stream->windows_cnt, cx, cy)) return false;
+		}
+	}
+	return true;
+}
+
+b32 level_stream_poll_spawn(LevelStream* stream, LevelSpawn* spawn) {
+	if (stream->spawns_polled == stream->spawns_cnt) return false;
+
+	*spawn = stream->spawns[stream->spawns_polled++];
+	return true;
+}
+
+// :debug draw impl
+// 3x5 glyphs from ' ' to 'Z', one bit per pixel from the top left, row by row
+const u16 __debug_font[] = {
+	0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x52a5, 0x0000, 0x0000,
+	0x2922, 0x224a, 0x0000, 0x05d0, 0x0014, 0x01c0, 0x0002, 0x12a4,
+	0x7b6f, 0x2c97, 0x73e7, 0x73cf, 0x5bc9, 0x79cf, 0x79ef, 0x7249,
+	0x7bef, 0x7bcf, 0x0410, 0x0000, 0x0000, 0x0e38, 0x0000, 0x0000,
+	0x0000, 0x2bed, 0x6bae, 0x3923, 0x6b6e, 0x79a7, 0x79a4, 0x396b,
+	0x5bed, 0x7497, 0x126a, 0x5bad, 0x4927, 0x5fed, 0x6b6d, 0x2b6a,
+	0x6ba4, 0x2b73, 0x6bad, 0x388e, 0x7492, 0x5b6f, 0x5b6a, 0x5bfd,
+	0x5aad, 0x5a92, 0x72a7,
+};
+
+DebugDraw debug_draw_new() {
+	return (DebugDraw) {
+		.imr = imr_new((IMR_Config) { 1024, 1 << 18 }),
+		.enabled = 0,
+	};
+}
+
+void debug_draw_delete(DebugDraw* dd) {
+	imr_delete(&dd->imr);
+}
+
+void debug_draw_begin(DebugDraw* dd) {
+	imr_begin(&dd->imr);
+}
+
+void debug_draw_flush(DebugDraw* dd, m4 mvp, IMR_View* views, u32 views_cnt) {
+	// Debug draws are not part of the captured stream
+	IMR_Capture* capture = ctx->capture;
+	ctx->capture = NULL;
+
+	if (dd->imr.buff_idx) {
+		imr_update_mvp(&dd->imr, mvp);
+		imr_set_views(&dd->imr, views, views_cnt);
+		imr_end(&dd->imr);
+	}
+	dd->imr.buff_idx = 0;
+
+	ctx->capture = capture;
+}
+
+void debug_draw_line(DebugDraw* dd, v2 a, v2 b, f32 thickness, v4 color) {
+	v2 d = { b.x - a.x, b.y - a.y };
+	f32 len = v2_mag(d);
+
+	// The quad is rotated over its center
+	imr_push_quad(
+		&dd->imr,
+		(v3) { (a.x + b.x - len) / 2, (a.y + b.y - thickness) / 2, 0 },
+		(v2) { len, thickness },
+		rotate_z(atan2f(d.y, d.x)),
+		color
+	);
+}
+
+void debug_draw_rect(DebugDraw* dd, Rect rect, v4 color) {
+	imr_push_quad(&dd->imr, (v3) { rect.x, rect.y, 0 }, (v2) { rect.w, rect.h }, rotate_x(0), color);
+}
+
+void debug_draw_rect_lines(DebugDraw* dd, Rect rect, v4 color) {
+	m4 rot = rotate_x(0);
+	imr_push_quad(&dd->imr, (v3) { rect.x, rect.y, 0 },              (v2) { rect.w, 1 }, rot, color);
+	imr_push_quad(&dd->imr, (v3) { rect.x, rect.y + rect.h - 1, 0 }, (v2) { rect.w, 1 }, rot, color);
+	imr_push_quad(&dd->imr, (v3) { rect.x, rect.y, 0 },              (v2) { 1, rect.h }, rot, color);
+	imr_push_quad(&dd->imr, (v3) { rect.x + rect.w - 1, rect.y, 0 }, (v2) { 1, rect.h }, rot, color);
+}
+
+void debug_draw_text(DebugDraw* dd, v2 pos, f32 scale, v4 color, const char* fmt, ...) {
+	char text[DEBUG_TEXT_CAP];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(text, sizeof(text), fmt, args);
+	va_end(args);
+
+	// Every lit pixel of a glyph is a quad, labels are short so this stays cheap
+	m4 rot = rotate_x(0);
+	v2 cursor = pos;
+	for (char* c = text; *c; c++) {
+		if (*c == '\n') {
+			cursor = (v2) { pos.x, cursor.y + (DEBUG_FONT_H + 1) * scale };
+			continue;
+		}
+
+		char ch = (*c >= 'a' && *c <= 'z') ? *c - 'a' + 'A' : *c;
+		u16 glyph = (ch >= ' ' && ch <= 'Z') ? __debug_font[ch - ' '] : 0;
+		for (u32 i = 0; i < DEBUG_FONT_W * DEBUG_FONT_H; i++) {
+			if (!(glyph & (1 << (DEBUG_FONT_W * DEBUG_FONT_H - 1 - i)))) continue;
+
+			imr_push_quad(
+				&dd->imr,
+				(v3) { cursor.x + (i % DEBUG_FONT_W) * scale, cursor.y + (i / DEBUG_FONT_W) * scale, 0 },
+				(v2) { scale, scale },
+				rot,
+				color
+			);
+		}
+		cursor.x += (DEBUG_FONT_W + 1) * scale;
+	}
+}
+
 // :external impl
 #define STB_IMAGE_IMPLEMENTATION
 #include "external/stb/stb_image.h"
@@ -4,13 +4,26 @@
 extern Context* ctx;
 
 // :flags
-// #define RENDER_RECTS
-// #define RENDER_HITRANGE
+// Debug draw categories, toggled with F4, F5 and F6
+typedef enum {
+	DEBUG_COLLIDERS = 1 << 0,
+	DEBUG_HITBOXES  = 1 << 1,
+	DEBUG_LABELS    = 1 << 2,
+} DebugCategory;
+
+b32 render_overdraw = false; // Toggled with F1
+b32 render_scaling = false;  // Toggled with F2
+b32 split_screen = false;    // Toggled with F3, local versus with the enemy on the arrow keys
+b32 edit_tiles = false;      // Toggled with F7, mouse 1 toggles the tile under the cursor
 
 // :const
 #define WIN_WIDTH  1280
 #define WIN_HEIGHT 720
 #define FPS 60
+#define SIM_RATE 60            // Simulation ticks per second, independent of the frame rate, see --sim-rate
+#define MAX_TICKS_PER_FRAME 5
+#define GPU_FRAME_TARGET_MS 12.0
+#define VRAM_BUDGET (64 * 1024 * 1024)
 
 // Character constants
 #define CHAR_SCALE 2
@@ -33,36 +46,78 @@ const v4 HIT_OVERLAY = { 1, 1, 1, 0.8 };
 #define HIT_RANGE_ON_DASH 500.0f
 #define HIT_DMG 10.0f;
 #define SWING_COOLDOWN 10.0f
-#define SWING_COOLDOWN_RATE 0.8f
-#define KNOCKBACK 50000.0f
+#define SWING_COOLDOWN_RATE 48.0f // Per second
+#define KNOCKBACK 1180.0f // Velocity given to the victim
 #define STUN_TIMEOUT 10.0f
-#define STUN_TIMEOUT_RATE 0.5f
+#define STUN_TIMEOUT_RATE 30.0f // Per second
 #define CONSEC_ATK_HOLD 2.0
 #define MAX_CONSEC_ATK 3.0f
 
 // Enemy constants
 #define ENEMY_ATK_COOLDOWN 20.0f
-#define ENEMY_ATK_COOLDOWN_RATE 0.1f
+#define ENEMY_ATK_COOLDOWN_RATE 6.0f // Per second
 #define PLAYER_TOO_CLOSE 200.0f
 #define IN_PLAYER_HITZONE HIT_RANGE + 20.0f
 #define ENEMY_DASH_PROBABILITY 30
+#define WAVE_SIZE 16
+#define WAVE_SPREAD 600.0f   // Around the player
+#define CORPSE_TIMEOUT 3.0f  // Seconds a wave enemy lies dead before it is removed
 
 // Physics constants
-#define GRAVITY_ACC 2000.0f
-#define VERT_ACC_THRESHOLD 50000.0f
+// Velocities are in pixels per second and accelerations in pixels per second squared,
+// the motion is integrated exactly over a tick so it doesnt depend on the tick rate
+#define GRAVITY_ACC 2050.0f
 #define AIR_FRICTION 0.95f
 #define GROUND_FRICTION 0.5f
-#define AIRTIME_THRESHOLD 50.0f
-#define AIRTIME_RATE 15.0f
+#define TUNING_RATE 60.0f // The frictions and the pushbox stiffness are given per 60th of a second
+#define AIRTIME_THRESHOLD 60.0f // Jumping accelerates until then
+#define AIRTIME_RATE 900.0f // Per second
+#define COLLISION_SKIN 0.01f // Bodies stop this far from walls so that they never start a tick inside them
+#define GRID_CELL_SIZE 128.0f    // About a character, most bodies cover one to four cells
+#define PUSHBOX_STIFFNESS 0.5f   // Part of the overlap between two bodies undone every 60th of a second
+#define SLEEP_DELAY 2.0f         // Seconds of rest before a body sleeps, longer than the death animation
+#define REST_SPEED 1.0f          // Below it the horizontal velocity counts as settled
+#define FOCUS_MARGIN 400.0f      // Around the views, past it the ai thinks at a reduced rate
+#define FAR_TICK_DIVISOR 4
 
 // Movement constants
-#define SPEED 10000.0f
-#define JUMP_ACC 30000.0f
-#define DASH_ACC 500000.0f
+#define SPEED 14180.0f
+#define JUMP_ACC 16940.0f
+#define DASH_SPEED 11820.0f // Given at once, the frictions eat it over about 260 px
 #define DASH_COOLDOWN 100.0f
-#define DASH_COOLDOWN_RATE 0.8f
+#define DASH_COOLDOWN_RATE 48.0f // Per second
 #define DASH_GHOST_ALPHA 0.7f
-#define DASH_GHOST_ALPHA_RATE 0.005f;
+#define DASH_GHOST_ALPHA_RATE 0.3f // Per second and ghost
+#define DASH_GHOST_ALPHA_STEP 0.005f // Between consecutive ghosts
+
+// Lighting constants
+const v4 AMBIENT_LIGHT = { 0.7, 0.7, 0.8, 1 };
+const v4 TORCH_LIGHT   = { 1, 0.6, 0.2, 1 };
+const v4 SWING_LIGHT   = { 1, 1, 0.8, 1 };
+#define TORCH_RADIUS 300.0f
+#define TORCH_FLICKER 20.0f
+#define SWING_FLASH_RADIUS 150.0f
+#define SWING_FLASH_RATE 6.0f // Per second
+
+// Level constants
+#define TILE_SIZE 10.0f
+#define LEVEL_WIDTH  128 // In tiles
+#define LEVEL_HEIGHT 80
+const v4 STONE_COLOR = { 0.1, 0.1, 0.1, 1 };
+
+#define LEVEL_STREAM_RADIUS 2 // Chunks kept resident past the view
+
+typedef enum {
+	TILE_STONE = 1,
+} TileKind;
+
+typedef enum {
+	SPAWN_PLAYER,
+	SPAWN_ENEMY,
+} SpawnKind;
+
+// Camera constants
+#define CAMERA_DELAY 10.0f
 
 // UI stuff
 #define PAUSE_BUTTON_WIDTH 50
@@ -79,51 +134,6 @@ const v4 HIT_OVERLAY = { 1, 1, 1, 0.8 };
 	(da)->items[(da)->count++] = (value);                                             \
 } while(0);                                                                         \
 
-static b32 LineIntersectsRect(v2 p0, v2 p1, Rect rect, v2* outHitPoint) {
-	float tmin = 0.0f;
-	float tmax = 1.0f;
-	v2 d = { p1.x - p0.x, p1.y - p0.y };
-	
-	float minX = rect.x;
-	float maxX = rect.x + rect.w;
-	float minY = rect.y;
-	float maxY = rect.y + rect.h;
-	
-	for (int i = 0; i < 2; i++) {
-		float origin = (i == 0) ? p0.x : p0.y;
-		float dir    = (i == 0) ? d.x  : d.y;
-		float min    = (i == 0) ? minX : minY;
-		float max    = (i == 0) ? maxX : maxY;
-		
-		if (dir == 0.0f) {
-			if (origin < min || origin > max)
-				return false; // No hit
-		} else {
-			float ood = 1.0f / dir;
-			float t1 = (min - origin) * ood;
-			float t2 = (max - origin) * ood;
-			
-			if (t1 > t2) {
-				float tmp = t1; t1 = t2; t2 = tmp;
-			}
-			
-			if (t1 > tmin) tmin = t1;
-			if (t2 < tmax) tmax = t2;
-			
-			if (tmin > tmax)
-				return false; // No overlap
-		}
-	}
-	
-	if (tmin < 0.0f || tmin > 1.0f)
-		return false; // Intersection not on segment
-	
-	if (outHitPoint)
-		*outHitPoint = v2_add(p0, v2_mul_scalar(d, tmin));
-	
-	return true;
-}
-
 /*
  * ---------------
  *   DEFINITIONS
@@ -194,12 +204,21 @@ typedef struct {
 	// as the texture is accessed through the entity id
 	Texture sprites[ENTITY_CNT];
 	Animator animators[ENTITY_CNT];
+
+	// Sheets are indexed, every look of a character is a row in the palette
+	Palette palette;
+	u32 player_row, enemy_row, dead_row;
 } SpriteManager;
 
 SpriteManager load_sprites();
 void delete_sprites(SpriteManager* sm);
 
 // :entity def
+// Every component lives in its own array so that a system only walks the columns it touches.
+// Systems take dense indices, those move when entities are removed so anything
+// that holds on to an entity keeps its handle instead.
+#define MAX_ENTITIES 4096
+
 typedef enum {
 	UP,
 	LEFT,
@@ -215,12 +234,31 @@ typedef enum {
 
 typedef struct {
 	v3 pos;
+	v3 prev_pos; // At the previous tick, rendering interpolates from it
 	v2 size;
 	Rect rect;
+} Transform;
+
+typedef struct {
+	b32 move[DIRS];
+	Dir face;
+} Motion;
 
-	// gameplay
+// Integrated a group of entities at a time (see physics_compute), so unlike the
+// other components every quantity is a column of its own
+typedef struct {
+	f32* acc_x;      // Summed over the tick, cleared once integrated
+	f32* acc_y;
+	f32* vel_x;
+	f32* vel_y;
+	f32* move_x;     // Displacement of the tick, resolved against the level
+	f32* move_y;
+	f32* airtime;
+	i32* jump_state; // JumpState
+	u32* awake;      // All bits set when awake, filled before integrating
+} Kinematics;
 
-	// combat
+typedef struct {
 	b32 attack;
 	b32 try_atk;
 	f32 atk_cooldown;
@@ -232,16 +270,7 @@ typedef struct {
 	f64 last_atk_time;
 	i32 consec_atk;
 	b32 do_consec_atk;
-
-	// dash
-	b32 dash;
-	b32 try_dash;
-	f32 dash_cooldown;
-	v3 dash_start_pos;
-	v3 dash_end_pos;
-	Rect frame_during_dash;
-	Dir face_during_dash;
-	f32 dash_ghost_alpha;
+	f32 swing_flash;
 
 	// damage
 	b32 hit;
@@ -250,50 +279,135 @@ typedef struct {
 	// health
 	f32 health;
 	b32 dead;
+	f32 despawn_timeout; // Counts down once dead, 0 keeps the corpse
+} Combat;
 
-	// render
-	Texture texture;
+typedef struct {
+	b32 dash;
+	b32 try_dash;
+	f32 dash_cooldown;
+	v3 dash_start_pos;
+	v3 dash_end_pos;
+	Rect frame_during_dash;
+	Dir face_during_dash;
+	f32 dash_ghost_alpha;
+} Dash;
 
-	// animation
+typedef struct {
 	AnimationID anim_state;
 	Animator animator;
-	Dir face;
-	JumpState jump_state;
 	Rect curr_frame;
+} Anim;
 
-	// physics
-	v2 vel;
-	v2 acc;
-	f32 airtime;
-	b32 move[DIRS];
-} Entity;
+typedef struct {
+	Texture texture;
+	u32 palette_row;
+	u32 dead_palette_row;
+} Sprite;
 
-Rect entity_get_rect(Entity* ent);
+// Resting bodies sleep, they are skipped by every system until something wakes them:
+// input, the ai, a hit, a push from another body or a change of the level
+typedef struct {
+	b32 asleep;
+	f32 idle_time; // Seconds without anything going on
+	b32 far;       // Outside of the focus
+	b32 frozen;    // Over chunks of a streamed level that arent resident, asleep until they are
+} Activity;
+
+typedef struct {
+	b32 ai;        // Driven by the enemy ai instead of the input
+	Handle target; // Entity the ai goes after
+} Brain;
+
+typedef struct {
+	SlotMap slots; // Its dense order is the order of the columns
+
+	Transform* transform;
+	Motion* motion;
+	Combat* combat;
+	Dash* dash;
+	Anim* anim;
+	Sprite* sprite;
+	Brain* brain;
+	Activity* activity;
+	Kinematics kin;
+
+	Rect focus;    // What the views show, see FOCUS_MARGIN
+	u64 ticks;
+	LevelStream* stream; // Bodies are only simulated over its resident chunks, NULL when it all is
+
+	// Live bodies by their rect, built at the start of every tick
+	SpatialGrid grid;
+	u32* nearby; // Query results
+} EntityStore;
+
+EntityStore entity_store_new(u32 capacity);
+void entity_store_delete(EntityStore* es);
+Handle entity_store_add(EntityStore* es); // Zeroed components
+void entity_store_remove(EntityStore* es, Handle entity); // At the end of the tick
+void entity_store_flush(EntityStore* es);
+void entity_store_update(EntityStore* es, CollisionWorld* world, f64 dt); // One tick of every system
+u32 entity_index(EntityStore* es, Handle entity); // Panics when stale
+void entity_store_set_focus(EntityStore* es, Rect focus);
+void entity_wake(EntityStore* es, u32 e);
+void entity_store_wake_all(EntityStore* es);      // After the level changed under them
+b32 entity_is_restless(EntityStore* es, u32 e);
+
+Rect entity_get_rect(EntityStore* es, u32 e);
+Rect transform_rect(Transform* t);
+v3 entity_lerp_pos(EntityStore* es, u32 e, f32 alpha); // Between the last two ticks
+void entity_teleport(EntityStore* es, u32 e, v2 pos);  // Moves without interpolating
 
 // :physics def
-void physics_movement(Entity* ent, f64 dt);
-void physics_compute(Entity* ent, f64 dt);
-void physics_resolve(Entity* ent, Rect* rects, i32 rects_cnt, f64 dt);
+void physics_movement(EntityStore* es, f64 dt);
+void physics_compute(EntityStore* es, f64 dt);
+void physics_resolve(EntityStore* es, CollisionWorld* world, f64 dt);
+void physics_broadphase(EntityStore* es);
+f32 physics_friction_rate(f32 friction);        // The friction as a decay per second
+f32 physics_impulse_travel(f32 vel_x);           // How far a velocity carries a body until the frictions eat it
+v3 physics_predict_impulse(EntityStore* es, u32 e, CollisionWorld* world, f32 vel_x); // Where it stops, walls included
+void physics_separate(EntityStore* es, f64 dt); // Pushes overlapping bodies apart
 
 // :char def
-Rect char_get_hitbox(Entity* ent);
-void char_handle_atk(Entity* ent, Entity* other);
-void char_handle_hit(Entity* ent);
-void char_handle_dash(Entity* ent, f64 dt);
-void char_render(Entity* ent, IMR* imr, v4 tint);
+Handle char_new(EntityStore* es, SpriteManager* sm, v2 pos, Dir face, u32 palette_row);
+Rect char_get_hitbox(EntityStore* es, u32 e);
+void char_handle_atk(EntityStore* es, u32 e);
+void char_handle_hit(EntityStore* es, u32 e, f64 dt);
+void char_handle_dash(EntityStore* es, u32 e, CollisionWorld* world, f64 dt);
+void char_animate(EntityStore* es, u32 e, f64 dt);  // Animation and effect state, once per tick
+i32 char_dash_ghosts(EntityStore* es, u32 e);
+void char_render(EntityStore* es, u32 e, IMR* imr, f32 alpha);
+void char_render_light(EntityStore* es, u32 e, Lighting* lighting, IMR* imr);
 
 // :player def
-Entity* player_new(SpriteManager* sm);
-void player_controller(Entity* ent, Event event);
-void player_update(Entity* ent, Entity* enemy, Rect* rects, i32 rects_cnt, f64 dt);
+Handle player_new(EntityStore* es, SpriteManager* sm);
+void player_controller(EntityStore* es, u32 e, Event event);
+void player2_controller(EntityStore* es, u32 e, Event event);
 
 // :enemy def
-Entity* enemy_new(SpriteManager* sm);
-void enemy_update(Entity* ent, Entity* player, Rect* rects, i32 rects_cnt, f64 dt);
+Handle enemy_new(EntityStore* es, SpriteManager* sm, Handle target);
+void enemy_spawn_wave(EntityStore* es, SpriteManager* sm, Handle target, Tilemap* level, CollisionWorld* world);
+void enemy_think(EntityStore* es, u32 e, f64 dt);
 
 // :ui def
+#define HEALTH_BAR_SIZE   ((v2) { 200, 20 })
+#define COOLDOWN_BAR_SIZE ((v2) { 200, 10 })
+#define PLAYER_HUD_RECT   ((Rect) { 0, 0, 220, 80 }) // Bounds of the player bars, what the ui layer caches
+
+void render_player_hud(IMR* imr, EntityStore* es, Handle player);
+void render_hud(IMR* imr, EntityStore* es, Handle enemy); // The rest of the hud, single quads that arent worth caching
+i32 progress_bar_length(v2 size, f32 val, f32 max); // In whole pixels, also the input of the ui layer
 void render_progress_bar(IMR* imr, v3 pos, v2 size, f32 val, f32 max, v4 color);
 
+// :background def
+// Both layers are twice as wide as the window and tile horizontally
+#define BACKGROUND_WIDTH  (WIN_WIDTH * 2)
+#define MOUNTAINS_FACTOR  0.2f
+#define PILLARS_FACTOR    0.5f
+
+void background_mountains(IMR* imr, u32 width, u32 height, void* data);
+void background_pillars(IMR* imr, u32 width, u32 height, void* data);
+
 
 /*
  * -------------------
@@ -371,11 +485,14 @@ Rect animator_get_frame(Animator* animator) {
 // :sprite impl
 SpriteManager load_sprites() {
 	SpriteManager sm = {0};
+	sm.palette = palette_new();
+	sm.player_row = palette_add_row(&sm.palette, PLAYER_TINT);
+	sm.enemy_row = palette_add_row(&sm.palette, ENEMY_TINT);
+	sm.dead_row = palette_add_row(&sm.palette, DEAD_TINT);
 
 	for (i32 i = 0; i < SPRITES_CNT; i++) {
 		SpriteSheet sprite = SPRITES[i];
-		Texture tex = texture_from_file(sprite.path, false);
-		texture_bind(tex);
+		Texture tex = texture_from_file_indexed(sprite.path, false, &sm.palette);
 
 		// Saving the texture
 		sm.sprites[sprite.id] = tex;
@@ -518,178 +635,580 @@ void delete_sprites(SpriteManager* sm) {
 		Animator am = sm->animators[i];
 		animator_delete(&am);
 	}
+	palette_delete(&sm->palette);
 }
 
 // :entity impl
-Rect entity_get_rect(Entity* ent) {
-	return rect_with_offset(
-		(v2) { ent->pos.x, ent->pos.y },
-		ent->rect
+EntityStore entity_store_new(u32 capacity) {
+	EntityStore es = {
+		.slots = slot_map_new(capacity),
+		.transform = mem_alloc(capacity * sizeof(Transform)),
+		.motion = mem_alloc(capacity * sizeof(Motion)),
+		.combat = mem_alloc(capacity * sizeof(Combat)),
+		.dash = mem_alloc(capacity * sizeof(Dash)),
+		.anim = mem_alloc(capacity * sizeof(Anim)),
+		.sprite = mem_alloc(capacity * sizeof(Sprite)),
+		.brain = mem_alloc(capacity * sizeof(Brain)),
+		.activity = mem_alloc(capacity * sizeof(Activity)),
+		.kin = {
+			.acc_x = mem_alloc(capacity * sizeof(f32)),
+			.acc_y = mem_alloc(capacity * sizeof(f32)),
+			.vel_x = mem_alloc(capacity * sizeof(f32)),
+			.vel_y = mem_alloc(capacity * sizeof(f32)),
+			.move_x = mem_alloc(capacity * sizeof(f32)),
+			.move_y = mem_alloc(capacity * sizeof(f32)),
+			.airtime = mem_alloc(capacity * sizeof(f32)),
+			.jump_state = mem_alloc(capacity * sizeof(i32)),
+			.awake = mem_alloc(capacity * sizeof(u32)),
+		},
+		.focus = { 0, 0, WIN_WIDTH, WIN_HEIGHT },
+		.ticks = 0,
+		.grid = spatial_grid_new(GRID_CELL_SIZE, capacity),
+		.nearby = mem_alloc(capacity * sizeof(u32)),
+	};
+	return es;
+}
+
+void entity_store_delete(EntityStore* es) {
+	slot_map_delete(&es->slots);
+	mem_free(es->transform);
+	mem_free(es->motion);
+	mem_free(es->combat);
+	mem_free(es->dash);
+	mem_free(es->anim);
+	mem_free(es->sprite);
+	mem_free(es->brain);
+	mem_free(es->activity);
+	mem_free(es->kin.acc_x);
+	mem_free(es->kin.acc_y);
+	mem_free(es->kin.vel_x);
+	mem_free(es->kin.vel_y);
+	mem_free(es->kin.move_x);
+	mem_free(es->kin.move_y);
+	mem_free(es->kin.airtime);
+	mem_free(es->kin.jump_state);
+	mem_free(es->kin.awake);
+	spatial_grid_delete(&es->grid);
+	mem_free(es->nearby);
+}
+
+Handle entity_store_add(EntityStore* es) {
+	Handle entity = slot_map_create(&es->slots);
+
+	u32 e = es->slots.count - 1;
+	memset(&es->transform[e], 0, sizeof(Transform));
+	memset(&es->motion[e], 0, sizeof(Motion));
+	memset(&es->combat[e], 0, sizeof(Combat));
+	memset(&es->dash[e], 0, sizeof(Dash));
+	memset(&es->anim[e], 0, sizeof(Anim));
+	memset(&es->sprite[e], 0, sizeof(Sprite));
+	memset(&es->brain[e], 0, sizeof(Brain));
+	memset(&es->activity[e], 0, sizeof(Activity));
+	es->kin.acc_x[e] = es->kin.acc_y[e] = 0.0f;
+	es->kin.vel_x[e] = es->kin.vel_y[e] = 0.0f;
+	es->kin.move_x[e] = es->kin.move_y[e] = 0.0f;
+	es->kin.airtime[e] = 0.0f;
+	es->kin.jump_state[e] = JS_ASCENT;
+	return entity;
+}
+
+void entity_store_remove(EntityStore* es, Handle entity) {
+	slot_map_defer_destroy(&es->slots, entity);
+}
+
+void entity_store_flush(EntityStore* es) {
+	Handle entity;
+	while (slot_map_pop_deferred(&es->slots, &entity)) {
+		u32 e = slot_map_destroy(&es->slots, entity);
+		u32 last = es->slots.count;
+		if (e == DENSE_NULL || e == last) continue;
+
+		// The columns follow the slot map, the last entity fills the hole
+		es->transform[e] = es->transform[last];
+		es->motion[e] = es->motion[last];
+		es->combat[e] = es->combat[last];
+		es->dash[e] = es->dash[last];
+		es->anim[e] = es->anim[last];
+		es->sprite[e] = es->sprite[last];
+		es->brain[e] = es->brain[last];
+		es->activity[e] = es->activity[last];
+		es->kin.acc_x[e] = es->kin.acc_x[last];
+		es->kin.acc_y[e] = es->kin.acc_y[last];
+		es->kin.vel_x[e] = es->kin.vel_x[last];
+		es->kin.vel_y[e] = es->kin.vel_y[last];
+		es->kin.move_x[e] = es->kin.move_x[last];
+		es->kin.move_y[e] = es->kin.move_y[last];
+		es->kin.airtime[e] = es->kin.airtime[last];
+		es->kin.jump_state[e] = es->kin.jump_state[last];
+	}
+}
+
+u32 entity_index(EntityStore* es, Handle entity) {
+	u32 e = slot_map_index(&es->slots, entity);
+	panic(e != DENSE_NULL, "Stale entity handle: %x\n", entity);
+	return e;
+}
+
+void entity_store_set_focus(EntityStore* es, Rect focus) {
+	es->focus = (Rect) {
+		focus.x - FOCUS_MARGIN,
+		focus.y - FOCUS_MARGIN,
+		focus.w + 2 * FOCUS_MARGIN,
+		focus.h + 2 * FOCUS_MARGIN,
+	};
+}
+
+void entity_wake(EntityStore* es, u32 e) {
+	// Nothing to stand on until the level around it pages in
+	if (es->activity[e].frozen) return;
+
+	es->activity[e].asleep = false;
+	es->activity[e].idle_time = 0.0f;
+}
+
+void entity_store_wake_all(EntityStore* es) {
+	for (u32 e = 0; e < es->slots.count; e++)
+		entity_wake(es, e);
+}
+
+b32 entity_is_restless(EntityStore* es, u32 e) {
+	Motion* m = &es->motion[e];
+	Combat* c = &es->combat[e];
+	Dash* d = &es->dash[e];
+
+	// Off the ground or still carried by an impulse
+	if (es->kin.jump_state[e] != JS_STILL || fabsf(es->kin.vel_x[e]) > REST_SPEED) return true;
+	if (c->hit) return true;
+
+	// The dead dont take input anymore
+	if (c->dead) return false;
+
+	return (
+		m->move[UP] || m->move[LEFT] || m->move[RIGHT] ||
+		c->try_atk || c->attack || c->do_consec_atk || d->try_dash || d->dash ||
+		c->swing_cooldown > 0.0f || c->atk_cooldown > 0.0f || d->dash_cooldown > 0.0f ||
+		c->swing_flash > 0.0f
 	);
 }
 
-// :physics impl
-void physics_movement(Entity* ent, f64 dt) {
-	if (ent->move[UP] &&
-		ent->airtime < AIRTIME_THRESHOLD)
-		ent->acc.y -= JUMP_ACC;
-
-	if (ent->move[LEFT]) {
-		ent->acc.x -= SPEED;
-		ent->face = LEFT;
+void entity_store_update(EntityStore* es, CollisionWorld* world, f64 dt) {
+	es->ticks++;
+
+	for (u32 e = 0; e < es->slots.count; e++) {
+		Activity* act = &es->activity[e];
+		Rect rect = entity_get_rect(es, e);
+		es->transform[e].prev_pos = es->transform[e].pos;
+		act->far = !rect_intersect_inclusive(rect, es->focus);
+
+		// Held in place while the level under it is paged out, else it would fall through
+		b32 was_frozen = act->frozen;
+		act->frozen = es->stream && !level_stream_covers(es->stream, rect);
+		if (act->frozen) {
+			act->asleep = true;
+		} else if (was_frozen) {
+			entity_wake(es, e);
+		}
+	}
+	physics_broadphase(es);
+
+	// Far away entities think at a reduced rate, spread over the ticks
+	for (u32 e = 0; e < es->slots.count; e++) {
+		if (!es->brain[e].ai || es->activity[e].frozen) continue;
+		if (!es->activity[e].far) {
+			enemy_think(es, e, dt);
+		} else if ((es->ticks + e) % FAR_TICK_DIVISOR == 0) {
+			enemy_think(es, e, dt * FAR_TICK_DIVISOR);
+		}
 	}
 
-	if (ent->move[RIGHT]) {
-		ent->acc.x += SPEED;
-		ent->face = RIGHT;
+	// Input and the ai wake a body up before the systems run
+	for (u32 e = 0; e < es->slots.count; e++) {
+		if (es->activity[e].asleep && entity_is_restless(es, e)) entity_wake(es, e);
 	}
-}
 
-void physics_compute(Entity* ent, f64 dt) {
-	// Add gravity
-	ent->acc.y += GRAVITY_ACC;
+	// Dead entities only recover from the hit
+	for (u32 e = 0; e < es->slots.count; e++) {
+		if (es->activity[e].asleep) continue;
 
-	// Cap the vertical acceleration
-	if (fabsf(ent->acc.y) > VERT_ACC_THRESHOLD) {
-		if (ent->acc.y < 0)
-			ent->acc.y = -VERT_ACC_THRESHOLD;
-		else
-			ent->acc.y = VERT_ACC_THRESHOLD;
+		if (!es->combat[e].dead) {
+			char_handle_atk(es, e);
+			char_handle_dash(es, e, world, dt);
+		}
+		char_handle_hit(es, e, dt);
 	}
 
-	// calculate velocity (v = u + a * t)
-	ent->vel = v2_add(
-		ent->vel,
-		v2_mul_scalar(ent->acc, (f32) dt)
-	);
+	physics_movement(es, dt);
+	physics_compute(es, dt);
+	physics_separate(es, dt);
+	physics_resolve(es, world, dt);
 
-	// Increasing the airtime
-	ent->airtime += AIRTIME_RATE;
+	for (u32 e = 0; e < es->slots.count; e++) {
+		Activity* act = &es->activity[e];
+		Combat* c = &es->combat[e];
 
-	// Set the entity movement states
-	if (ent->vel.y > 0) {
-		ent->jump_state = JS_DESCENT;
-	} else if (ent->vel.y < 0) {
-		ent->jump_state = JS_ASCENT;
+		// Nothing left to animate on a sleeping corpse, and nobody sees a sleeper far away
+		if (!(act->asleep && (c->dead || act->far))) char_animate(es, e, dt);
+
+		if (!act->asleep) {
+			act->idle_time = entity_is_restless(es, e) ? 0.0f : act->idle_time + dt;
+			act->asleep = act->idle_time >= SLEEP_DELAY;
+		}
+
+		if (c->dead && c->despawn_timeout > 0.0f) {
+			c->despawn_timeout -= dt;
+			if (c->despawn_timeout <= 0.0f)
+				entity_store_remove(es, slot_map_handle(&es->slots, e));
+		}
 	}
+
+	entity_store_flush(es);
 }
 
-void physics_resolve(Entity* ent, Rect* rects, i32 rects_cnt, f64 dt) {
-	// X-axis collision resolution
-	{
-		v2 p0, p1;
-		Rect target = entity_get_rect(ent);
-
-		// Point infront of the entity before moving
-		if (ent->face == RIGHT) {
-			p0 = (v2) {
-				target.x + target.w,
-				target.y + target.h / 2,
-			};
-		} else {
-			p0 = (v2) {
-				target.x,
-				target.y + target.h / 2
-			};
-		}
+Rect entity_get_rect(EntityStore* es, u32 e) {
+	return transform_rect(&es->transform[e]);
+}
 
-		ent->pos.x += ent->vel.x * dt;
+Rect transform_rect(Transform* t) {
+	return rect_with_offset(
+		(v2) { t->pos.x, t->pos.y },
+		t->rect
+	);
+}
 
-		target = entity_get_rect(ent);
+v3 entity_lerp_pos(EntityStore* es, u32 e, f32 alpha) {
+	Transform* t = &es->transform[e];
 
-		// Point infront of the entity after moving
-		if (ent->face == RIGHT) {
-			p1 = (v2) {
-				target.x + target.w,
-				target.y + target.h / 2,
-			};
-		} else {
-			p1 = (v2) {
-				target.x,
-				target.y + target.h / 2
-			};
+	return (v3) {
+		t->prev_pos.x + (t->pos.x - t->prev_pos.x) * alpha,
+		t->prev_pos.y + (t->pos.y - t->prev_pos.y) * alpha,
+		t->pos.z
+	};
+}
+
+void entity_teleport(EntityStore* es, u32 e, v2 pos) {
+	Transform* t = &es->transform[e];
+
+	t->pos.x = t->prev_pos.x = pos.x;
+	t->pos.y = t->prev_pos.y = pos.y;
+}
+
+// :physics impl
+void physics_movement(EntityStore* es, f64 dt) {
+	for (u32 e = 0; e < es->slots.count; e++) {
+		Motion* m = &es->motion[e];
+		if (es->combat[e].dead || es->activity[e].asleep) continue;
+
+		// Only the part of the tick before the airtime runs out, whatever the tick length
+		if (m->move[UP] && es->kin.airtime[e] < AIRTIME_THRESHOLD) {
+			f32 jumping = (AIRTIME_THRESHOLD - es->kin.airtime[e]) / (AIRTIME_RATE * dt);
+			es->kin.acc_y[e] -= JUMP_ACC * fminf(jumping, 1.0f);
 		}
 
-		// Loop through all collision bodies
-		for (i32 i = 0; i < rects_cnt; i++) {
-			Rect rect = rects[i];
+		if (m->move[LEFT]) {
+			es->kin.acc_x[e] -= SPEED;
+			m->face = LEFT;
+		}
 
-			v2 hit = {0};
+		if (m->move[RIGHT]) {
+			es->kin.acc_x[e] += SPEED;
+			m->face = RIGHT;
+		}
+	}
+}
 
-			// Checking if there is a rect inbetween of those points
-			if (LineIntersectsRect(p0, p1, rect, &hit)) {
+#ifdef __SSE2__
+// The lanes of a where the mask is set and of b elsewhere
+static inline __m128 physics_select(__m128 mask, __m128 a, __m128 b) {
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+#endif
 
-				// Resolving if there exists a collision
-				if (ent->face == RIGHT) {
-					if (hit.x < target.x + target.w) {
-						ent->pos.x = hit.x - (ent->rect.x + ent->rect.w);
-					}
-				} else {
-					if (hit.x > target.x) {
-						ent->pos.x = hit.x - ent->rect.x;
-					}
-				}
+f32 physics_friction_rate(f32 friction) {
+	return -logf(friction) * TUNING_RATE;
+}
 
-				// Since the X collision is resolved for that rect
-				// No further resolution is needed
-				continue;
-			}
+void physics_compute(EntityStore* es, f64 dt) {
+	Kinematics* k = &es->kin;
+	u32 count = es->slots.count;
+
+	// Both paths integrate in single precision, an entity gets the same result whatever its lane
+	f32 step = dt;
+
+	// With a constant acceleration a and the frictions as a decay at rate r the velocity tends
+	// to a / r, the tick is integrated exactly:
+	//   v' = a / r + (v - a / r) * e^(-r * t)
+	//   d  = a / r * t + (v - a / r) * (1 - e^(-r * t)) / r
+	// The decay over the tick is the same for every body, only a and v differ
+	f32 rate_x = physics_friction_rate(AIR_FRICTION * GROUND_FRICTION);
+	f32 rate_y = physics_friction_rate(AIR_FRICTION);
+	f32 decay_x = powf(AIR_FRICTION * GROUND_FRICTION, step * TUNING_RATE);
+	f32 decay_y = powf(AIR_FRICTION, step * TUNING_RATE);
+	f32 spread_x = (1.0f - decay_x) / rate_x;
+	f32 spread_y = (1.0f - decay_y) / rate_y;
+
+	// Sleepers keep their state, every lane is computed and only the awake ones are stored
+	for (u32 e = 0; e < count; e++)
+		k->awake[e] = es->activity[e].asleep ? 0 : 0xffffffff;
+
+	u32 e = 0;
+#ifdef __SSE2__
+	__m128 steps = _mm_set1_ps(step);
+	__m128 gravity = _mm_set1_ps(GRAVITY_ACC);
+	__m128 inv_rate_x = _mm_set1_ps(1.0f / rate_x);
+	__m128 inv_rate_y = _mm_set1_ps(1.0f / rate_y);
+	__m128 decays_x = _mm_set1_ps(decay_x);
+	__m128 decays_y = _mm_set1_ps(decay_y);
+	__m128 spreads_x = _mm_set1_ps(spread_x);
+	__m128 spreads_y = _mm_set1_ps(spread_y);
+	__m128 airtime_step = _mm_set1_ps(AIRTIME_RATE * step);
+	__m128 zero = _mm_setzero_ps();
+	__m128i descent = _mm_set1_epi32(JS_DESCENT);
+	__m128i ascent = _mm_set1_epi32(JS_ASCENT);
+
+	for (; e + 4 <= count; e += 4) {
+		__m128 awake = _mm_loadu_ps((f32*) (k->awake + e));
+		__m128 acc_x = _mm_loadu_ps(k->acc_x + e);
+		__m128 acc_y = _mm_loadu_ps(k->acc_y + e);
+		__m128 vel_x = _mm_loadu_ps(k->vel_x + e);
+		__m128 vel_y = _mm_loadu_ps(k->vel_y + e);
+		__m128 airtime = _mm_loadu_ps(k->airtime + e);
+		__m128i jump_state = _mm_loadu_si128((__m128i*) (k->jump_state + e));
+
+		// Where the velocity tends to and how far it is from it
+		__m128 limit_x = _mm_mul_ps(acc_x, inv_rate_x);
+		__m128 limit_y = _mm_mul_ps(_mm_add_ps(acc_y, gravity), inv_rate_y);
+		__m128 gap_x = _mm_sub_ps(vel_x, limit_x);
+		__m128 gap_y = _mm_sub_ps(vel_y, limit_y);
+
+		__m128 new_vel_x = _mm_add_ps(limit_x, _mm_mul_ps(gap_x, decays_x));
+		__m128 new_vel_y = _mm_add_ps(limit_y, _mm_mul_ps(gap_y, decays_y));
+		__m128 move_x = _mm_add_ps(_mm_mul_ps(limit_x, steps), _mm_mul_ps(gap_x, spreads_x));
+		__m128 move_y = _mm_add_ps(_mm_mul_ps(limit_y, steps), _mm_mul_ps(gap_y, spreads_y));
+		__m128 new_airtime = _mm_add_ps(airtime, airtime_step);
+
+		// Movement state from the vertical motion, unchanged when still
+		__m128i falling = _mm_castps_si128(_mm_cmpgt_ps(move_y, zero));
+		__m128i rising = _mm_castps_si128(_mm_cmplt_ps(move_y, zero));
+		__m128i new_jump_state = _mm_or_si128(
+			_mm_or_si128(_mm_and_si128(falling, descent), _mm_and_si128(rising, ascent)),
+			_mm_andnot_si128(_mm_or_si128(falling, rising), jump_state)
+		);
 
-			// Resolution
-			if (rect_intersect(target, rect)) {
-				if (ent->vel.x > 0) {
-					f32 dx = target.x + target.w - rect.x;
-					ent->pos.x -= dx;
-				} else if (ent->vel.x < 0) {
-					f32 dx = rect.x + rect.w - target.x;
-					ent->pos.x += dx;
-				}
-			}
+		// Keeping the sleeping lanes as they were, they dont move
+		_mm_storeu_ps(k->acc_x + e, physics_select(awake, zero, acc_x));
+		_mm_storeu_ps(k->acc_y + e, physics_select(awake, zero, acc_y));
+		_mm_storeu_ps(k->vel_x + e, physics_select(awake, new_vel_x, vel_x));
+		_mm_storeu_ps(k->vel_y + e, physics_select(awake, new_vel_y, vel_y));
+		_mm_storeu_ps(k->move_x + e, _mm_and_ps(awake, move_x));
+		_mm_storeu_ps(k->move_y + e, _mm_and_ps(awake, move_y));
+		_mm_storeu_ps(k->airtime + e, physics_select(awake, new_airtime, airtime));
+		_mm_storeu_si128(
+			(__m128i*) (k->jump_state + e),
+			_mm_castps_si128(physics_select(awake, _mm_castsi128_ps(new_jump_state), _mm_castsi128_ps(jump_state)))
+		);
+	}
+#endif
+
+	// What is left over, or everything without sse
+	for (; e < count; e++) {
+		k->move_x[e] = k->move_y[e] = 0.0f;
+		if (!k->awake[e]) continue;
+
+		// Add gravity
+		f32 acc_y = k->acc_y[e] + GRAVITY_ACC;
+
+		// Where the velocity tends to and how far it is from it
+		f32 limit_x = k->acc_x[e] * (1.0f / rate_x);
+		f32 limit_y = acc_y * (1.0f / rate_y);
+		f32 gap_x = k->vel_x[e] - limit_x;
+		f32 gap_y = k->vel_y[e] - limit_y;
+
+		k->vel_x[e] = limit_x + gap_x * decay_x;
+		k->vel_y[e] = limit_y + gap_y * decay_y;
+		k->move_x[e] = limit_x * step + gap_x * spread_x;
+		k->move_y[e] = limit_y * step + gap_y * spread_y;
+		k->acc_x[e] = k->acc_y[e] = 0.0f;
+
+		// Increasing the airtime
+		k->airtime[e] += AIRTIME_RATE * step;
+
+		// Set the entity movement states
+		if (k->move_y[e] > 0) {
+			k->jump_state[e] = JS_DESCENT;
+		} else if (k->move_y[e] < 0) {
+			k->jump_state[e] = JS_ASCENT;
 		}
 	}
+}
 
-	// Y-axis collision resolution
-	{
-		ent->pos.y += ent->vel.y * dt;
-
-		// Loop through all collision bodies
-		for (i32 i = 0; i < rects_cnt; i++) {
-			Rect rect = rects[i];
-			Rect target = entity_get_rect(ent);
-
-			// Resolution
-			if (rect_intersect(target, rect)) {
-				if (ent->vel.y > 0) {
-					f32 dy = target.y + target.h - rect.y;
-					ent->pos.y -= dy;
-
-					// Reset airtime when on the ground
-					ent->airtime = 0;
-					ent->jump_state = JS_STILL;
-				} else if (ent->vel.y < 0) {
-					f32 dy = rect.y + rect.h - target.y;
-					ent->pos.y += dy;
+void physics_resolve(EntityStore* es, CollisionWorld* world, f64 dt) {
+	for (u32 e = 0; e < es->slots.count; e++) {
+		Transform* t = &es->transform[e];
+		Kinematics* k = &es->kin;
+		if (es->activity[e].asleep) continue;
+
+		// Both axes are swept with the whole body, it stops at the earliest impact
+		// whatever the speed. The sides the body isnt moving towards are pulled in by
+		// the skin so that sliding along the floor or a wall doesnt count as a hit.
+
+		// X-axis collision resolution
+		f32 dx = k->move_x[e];
+		if (dx != 0.0f) {
+			Rect body = transform_rect(t);
+			body.y += COLLISION_SKIN;
+			body.h -= 2 * COLLISION_SKIN;
+
+			f32 toi;
+			if (collision_world_sweep(world, body, (v2) { dx, 0 }, &toi)) {
+				f32 travel = fmaxf(fabsf(dx) * toi - COLLISION_SKIN, 0.0f);
+				dx = dx > 0 ? travel : -travel;
+				k->vel_x[e] = 0.0f;
+			}
+			t->pos.x += dx;
+		}
+
+		// Y-axis collision resolution
+		f32 dy = k->move_y[e];
+		if (dy != 0.0f) {
+			Rect body = transform_rect(t);
+			body.x += COLLISION_SKIN;
+			body.w -= 2 * COLLISION_SKIN;
+
+			f32 toi;
+			if (collision_world_sweep(world, body, (v2) { 0, dy }, &toi)) {
+				f32 travel = fmaxf(fabsf(dy) * toi - COLLISION_SKIN, 0.0f);
+				dy = dy > 0 ? travel : -travel;
+
+				// Reset airtime when on the ground
+				if (k->move_y[e] > 0) {
+					k->airtime[e] = 0;
+					k->jump_state[e] = JS_STILL;
 				}
+				k->vel_y[e] = 0.0f;
 			}
+			t->pos.y += dy;
+		}
+
+		// Level geometry that appeared on top of a body, like an edited tile, isnt swept
+		// against so the body is lifted out of it
+		u32 rects_cnt;
+		Rect* rects = collision_world_query(world, transform_rect(t), &rects_cnt);
+		for (u32 i = 0; i < rects_cnt; i++) {
+			Rect target = transform_rect(t);
+			if (rect_intersect(target, rects[i]))
+				t->pos.y -= target.y + target.h - rects[i].y + COLLISION_SKIN;
 		}
 	}
+}
 
-	// Applying frictions
-	ent->acc = v2_mul_scalar(ent->acc, AIR_FRICTION);
-	ent->acc.x *= GROUND_FRICTION;
+f32 physics_impulse_travel(f32 vel_x) {
+	// The velocity decays as v * e^(-r * t), its integral over all time is v / r
+	return vel_x / physics_friction_rate(AIR_FRICTION * GROUND_FRICTION);
+}
+
+v3 physics_predict_impulse(EntityStore* es, u32 e, CollisionWorld* world, f32 vel_x) {
+	Transform* t = &es->transform[e];
+	Rect rect = transform_rect(t);
+	f32 travel = physics_impulse_travel(vel_x);
+
+	// Stopping at the first wall in the way of the body, like physics_resolve does
+	rect.y += COLLISION_SKIN;
+	rect.h -= 2 * COLLISION_SKIN;
+	f32 toi;
+	if (collision_world_sweep(world, rect, (v2) { travel, 0 }, &toi))
+		travel *= toi;
+
+	v3 end_pos = t->pos;
+	end_pos.x += travel;
+	return end_pos;
+}
+
+void physics_broadphase(EntityStore* es) {
+	spatial_grid_clear(&es->grid);
+	for (u32 e = 0; e < es->slots.count; e++) {
+		if (es->combat[e].dead) continue;
+		spatial_grid_insert(&es->grid, e, entity_get_rect(es, e));
+	}
+}
 
-	// Reset the velocity
-	ent->vel = (v2) { 0, 0 };
+void physics_separate(EntityStore* es, f64 dt) {
+	// The grid from the start of the tick still holds, nothing has moved or died since
+	// Who is awake is taken from the start of the pass (filled by physics_compute), the
+	// pushes below wake sleepers and every pair still has to be handled exactly once
+	u32* awake = es->kin.awake;
+
+	// The overlap shrinks at the same pace whatever the tick length
+	f32 undone = 1.0f - powf(1.0f - PUSHBOX_STIFFNESS, dt * TUNING_RATE);
+
+	for (u32 e = 0; e < es->slots.count; e++) {
+		// Dashing goes through the other bodies, sleepers are only found by the others
+		if (es->combat[e].dead || es->dash[e].dash || !awake[e]) continue;
+
+		Rect a = entity_get_rect(es, e);
+		u32 nearby_cnt = spatial_grid_query(&es->grid, a, es->nearby, es->slots.count);
+		for (u32 i = 0; i < nearby_cnt; i++) {
+			// Every pair once, by the lower index when both are awake and by the awake one otherwise
+			u32 o = es->nearby[i];
+			if (o == e || es->dash[o].dash) continue;
+			if (awake[o] && o < e) continue;
+
+			// Frozen bodies arent simulated, pushes into them would pile up until they thaw
+			if (es->activity[o].frozen) continue;
+
+			Rect b = entity_get_rect(es, o);
+			f32 overlap = fminf(a.x + a.w, b.x + b.w) - fmaxf(a.x, b.x);
+			if (overlap <= 0.0f) continue;
+
+			// Both are pushed away from the other by half, as part of the displacement
+			// of the tick so that the level resolution still keeps them out of the walls
+			f32 push = overlap * undone / 2;
+			if (a.x + a.w / 2 > b.x + b.w / 2) push = -push;
+			es->kin.move_x[e] -= push;
+			es->kin.move_x[o] += push;
+
+			// Bumping into a sleeper wakes it
+			entity_wake(es, e);
+			entity_wake(es, o);
+		}
+	}
 }
 
 // :char impl
-Rect char_get_hitbox(Entity* ent) {
-	Rect rect = entity_get_rect(ent);
+Handle char_new(EntityStore* es, SpriteManager* sm, v2 pos, Dir face, u32 palette_row) {
+	Handle entity = entity_store_add(es);
+	u32 e = entity_index(es, entity);
+	Transform* t = &es->transform[e];
+	Motion* m = &es->motion[e];
+	Combat* c = &es->combat[e];
+	Dash* d = &es->dash[e];
+	Anim* a = &es->anim[e];
+	Sprite* r = &es->sprite[e];
+
+	t->pos = (v3) { pos.x, pos.y, 0 };
+	t->prev_pos = t->pos;
+	t->size = CHAR_SIZE;
+	t->rect = CHAR_RECT;
+	r->texture = sm->sprites[E_SAMURAI];
+	r->palette_row = palette_row;
+	r->dead_palette_row = sm->dead_row;
+	a->animator = sm->animators[E_SAMURAI];
+	m->face = face;
+	c->health = 100.0f;
+	d->dash_ghost_alpha = DASH_GHOST_ALPHA;
+
+	return entity;
+}
+
+Rect char_get_hitbox(EntityStore* es, u32 e) {
+	Motion* m = &es->motion[e];
+	Dash* d = &es->dash[e];
+
+	Rect rect = entity_get_rect(es, e);
 
 	f32 hit_range = HIT_RANGE;
 
 	// Increasing the hit range during dashing
-	if (ent->dash) {
+	if (d->dash) {
 		hit_range += HIT_RANGE_ON_DASH;
 	}
 
@@ -700,14 +1219,14 @@ Rect char_get_hitbox(Entity* ent) {
 	};
 
 	// Setting up the hitbox start position according to the dash and face direction
-	if (ent->face == LEFT) {
-		if (ent->dash) {
+	if (m->face == LEFT) {
+		if (d->dash) {
 			hitbox.x = rect.x - hit_range / 3.0f;
 		} else {
 			hitbox.x = rect.x - hit_range;
 		}
 	} else {
-		if (ent->dash) {
+		if (d->dash) {
 			hitbox.x = rect.x + rect.w - hit_range / 1.5f;
 		} else {
 			hitbox.x = rect.x + rect.w;
@@ -717,211 +1236,226 @@ Rect char_get_hitbox(Entity* ent) {
 	return hitbox;
 }
 
-void char_handle_atk(Entity* ent, Entity* other) {
+void char_handle_atk(EntityStore* es, u32 e) {
+	Motion* m = &es->motion[e];
+	Combat* c = &es->combat[e];
+
 	// If the entity hasnt attacked for too long then reset the consecutive attack counter
-	if (fabs(ent->last_atk_time - glfwGetTime()) >= CONSEC_ATK_HOLD) {
-		ent->consec_atk = 0;
+	if (fabs(c->last_atk_time - glfwGetTime()) >= CONSEC_ATK_HOLD) {
+		c->consec_atk = 0;
 	}
 
 	// Do attack
 	if (
-		ent->try_atk &&                       // When entity tried to attack
-		ent->atk_cooldown == 0.0f &&          // If the attack cooldown is 0
-		ent->swing_cooldown == 0.0f &&        // If the swing cooldown is 0
-		ent->consec_atk < MAX_CONSEC_ATK      // If the entity hasnt exhausted cosecutive attacks
+		c->try_atk &&                       // When entity tried to attack
+		c->atk_cooldown == 0.0f &&          // If the attack cooldown is 0
+		c->swing_cooldown == 0.0f &&        // If the swing cooldown is 0
+		c->consec_atk < MAX_CONSEC_ATK      // If the entity hasnt exhausted cosecutive attacks
 	) {
-		ent->attack = true;
-		ent->consec_atk++;
+		c->attack = true;
+		c->consec_atk++;
+		c->swing_flash = 1.0f;
 
 		// Record the attack time
-		ent->last_atk_time = glfwGetTime();
+		c->last_atk_time = glfwGetTime();
 	}
 	
-	Rect hitbox = char_get_hitbox(ent);
-	Rect o_rect = entity_get_rect(other);
-
-	// Give knockback and stun to the other entity when attacked
-	if (
-		ent->attack  &&                               // When able to attack
-		!other->dead &&                               // And when the other guy is alive
+	if (!c->attack) return;
+
+	// Give knockback and stun to every other entity the swing reaches
+	Rect hitbox = char_get_hitbox(es, e);
+	u32 nearby_cnt = spatial_grid_query(&es->grid, hitbox, es->nearby, es->slots.count);
+	for (u32 i = 0; i < nearby_cnt; i++) {
+		u32 o = es->nearby[i];
+		Combat* other = &es->combat[o];
+		if (
+			o == e ||                                                 // Not self
+			other->dead ||                                            // And when the other guy is alive
 //	TODO: Maybe introduce someday?
-//	!ent->hit    &&                               // And self shouldnt be hit at the moment
-		rect_intersect_inclusive(o_rect, hitbox)      // The hitbox and rect of the other should collide
-	) {
-		if (ent->face == LEFT) {
-			other->acc.x -= KNOCKBACK;
+//	c->hit ||                                                 // And self shouldnt be hit at the moment
+			!rect_intersect_inclusive(entity_get_rect(es, o), hitbox) // The hitbox and rect of the other should collide
+		) continue;
+
+		if (m->face == LEFT) {
+			es->kin.vel_x[o] -= KNOCKBACK;
 		} else {
-			other->acc.x += KNOCKBACK;
+			es->kin.vel_x[o] += KNOCKBACK;
 		}
 		other->hit = true;
 		other->stun_timeout = STUN_TIMEOUT;
+		entity_wake(es, o);
 
 		// Give damage to the other entity
 		other->health -= HIT_DMG;
 	}
-
-#ifdef RENDER_HITRANGE
-	imr_push_quad(
-		ctx->inner,
-		(v3) { hitbox.x, hitbox.y, ent->pos.z },
-		(v2) { hitbox.w, hitbox.h },
-		rotate_y(0),
-		(v4) { 1, 1, 0, 0.5 }
-	);
-#endif
 }
 
-void char_handle_hit(Entity* ent) {
-	if (!ent->hit) return;
+void char_handle_hit(EntityStore* es, u32 e, f64 dt) {
+	Combat* c = &es->combat[e];
+
+	if (!c->hit) return;
 
 	// If a hit is encountered add a slight stun to movement
 
 	// TODO: This stuns the character when got hit. Maybe introduce this when needed?
 	// Reset states while being in stun state
-	// ent->move[LEFT] = ent->move[RIGHT] = ent->move[UP] = false;
-	// ent->try_atk = false;
+	// es->motion[e].move[LEFT] = es->motion[e].move[RIGHT] = es->motion[e].move[UP] = false;
+	// c->try_atk = false;
 
-	// TODO: Multiply rate with (dt) maybe?
-	ent->stun_timeout -= STUN_TIMEOUT_RATE;
-	if (ent->stun_timeout <= 0.0f)
-		ent->hit = false;
+	c->stun_timeout -= STUN_TIMEOUT_RATE * dt;
+	if (c->stun_timeout <= 0.0f)
+		c->hit = false;
 }
 
-void char_handle_dash(Entity* ent, f64 dt) {
+void char_handle_dash(EntityStore* es, u32 e, CollisionWorld* world, f64 dt) {
+	Transform* t = &es->transform[e];
+	Motion* m = &es->motion[e];
+	Dash* d = &es->dash[e];
+	Anim* a = &es->anim[e];
+
 	// TODO: What if I got hit during dash?
 	// Handle dashing
 
-	ent->dash = ent->try_dash && (ent->dash_cooldown == 0.0f);
-	if (ent->dash) {
-		switch (ent->face) {
+	d->dash = d->try_dash && (d->dash_cooldown == 0.0f);
+	if (d->dash) {
+		switch (m->face) {
 			case LEFT:
-				ent->acc.x -= DASH_ACC;
+				es->kin.vel_x[e] -= DASH_SPEED;
 				break;
 			case RIGHT:
-				ent->acc.x += DASH_ACC;
+				es->kin.vel_x[e] += DASH_SPEED;
 				break;
 		}
 
-		// Record the current state of the player
-		v3 start_pos = ent->pos;
-		v3 end_pos = ent->pos;
-		v2 acc = ent->acc;
-
-		// Do a simple acceleration simulation to find the end position after dashing
-		while (v2_mag(acc) > 0.0f) {
-			v2 vel = v2_add(
-				ent->vel,
-				v2_mul_scalar(acc, (f32) dt)
-			);
-
-			// Calculating end position
-			end_pos.x += vel.x * dt;
-
-			// Apply friction
-			acc = v2_mul_scalar(acc, AIR_FRICTION);
-			acc.x *= GROUND_FRICTION;
-		}
-
 		// Save the dash informations
-		ent->dash_start_pos = start_pos;
-		ent->dash_end_pos = end_pos;
-		ent->frame_during_dash = ent->curr_frame;
-		ent->face_during_dash = ent->face;
+		d->dash_start_pos = t->pos;
+		d->dash_end_pos = physics_predict_impulse(es, e, world, es->kin.vel_x[e]);
+		d->frame_during_dash = a->curr_frame;
+		d->face_during_dash = m->face;
 
 		// Set the dash cooldown
-		ent->dash_cooldown = DASH_COOLDOWN;
+		d->dash_cooldown = DASH_COOLDOWN;
 
 		// Setting up the alpha for dashing
-		ent->dash_ghost_alpha = DASH_GHOST_ALPHA;
+		d->dash_ghost_alpha = DASH_GHOST_ALPHA;
 	}
 
-	ent->try_dash = false;
-	ent->dash_cooldown -= DASH_COOLDOWN_RATE;
-	if (ent->dash_cooldown <= 0.0f) {
-		ent->dash_cooldown = 0.0f;
+	d->try_dash = false;
+	d->dash_cooldown -= DASH_COOLDOWN_RATE * dt;
+	if (d->dash_cooldown <= 0.0f) {
+		d->dash_cooldown = 0.0f;
 	}
 }
 
-void char_render(Entity* ent, IMR* imr, v4 tint) {
+void char_animate(EntityStore* es, u32 e, f64 dt) {
+	Motion* m = &es->motion[e];
+	Combat* c = &es->combat[e];
+	Dash* d = &es->dash[e];
+	Anim* a = &es->anim[e];
+
 	// If the character is in attack animation
 	// then skip the jump and walking animations
-	if (!ent->is_swing_complete)
+	if (!c->is_swing_complete)
 		goto skip_movement_state;
 
 	// Setting up walking animation
-	if (ent->move[LEFT] || ent->move[RIGHT]) {
-		ent->anim_state = WALK;
+	if (m->move[LEFT] || m->move[RIGHT]) {
+		a->anim_state = WALK;
 	} else {
-		ent->anim_state = IDLE;
+		a->anim_state = IDLE;
 	}
 
 	// If both left and right movement is on, set it to IDLE
-	if (ent->move[LEFT] && ent->move[RIGHT])
-		ent->anim_state = IDLE;
+	if (m->move[LEFT] && m->move[RIGHT])
+		a->anim_state = IDLE;
 
 	// Handling jump ascent and descent animation
-	switch (ent->jump_state) {
+	switch (es->kin.jump_state[e]) {
 		case JS_ASCENT:
-			ent->anim_state = ASCENT;
+			a->anim_state = ASCENT;
 			break;
 		case JS_DESCENT:
-			ent->anim_state = DESCENT;
+			a->anim_state = DESCENT;
 			break;
 		default: break;
 	}
 skip_movement_state:
 
-	if (ent->attack) {
+	if (c->attack) {
 		// Toggling between different swings
-		if (ent->prev_atk_frame == SWING_1) {
-			ent->anim_state = SWING_2;
-			ent->prev_atk_frame = SWING_2;
+		if (c->prev_atk_frame == SWING_1) {
+			a->anim_state = SWING_2;
+			c->prev_atk_frame = SWING_2;
 		} else {
-			ent->anim_state = SWING_1;
-			ent->prev_atk_frame = SWING_1;
+			a->anim_state = SWING_1;
+			c->prev_atk_frame = SWING_1;
 		}
 
 		// Stoping further attack by setting the cooldown
-		ent->attack = false;
-		ent->is_swing_complete = false;
-		ent->swing_cooldown = SWING_COOLDOWN;
+		c->attack = false;
+		c->is_swing_complete = false;
+		c->swing_cooldown = SWING_COOLDOWN;
 	}
 
 	// If the swing is complete then we start the swing cooldown for next swing
-	// TODO: Multiply rate with (dt) maybe?
-	if (ent->is_swing_complete && ent->swing_cooldown > 0.0f) {
-		ent->swing_cooldown -= SWING_COOLDOWN_RATE;
-		if (ent->swing_cooldown < 0.0f) {
-			ent->swing_cooldown = 0.0f;
+	if (c->is_swing_complete && c->swing_cooldown > 0.0f) {
+		c->swing_cooldown -= SWING_COOLDOWN_RATE * dt;
+		if (c->swing_cooldown < 0.0f) {
+			c->swing_cooldown = 0.0f;
 		}
 	}
 
 	// Making entity dead when the health drops below 0
-	if (ent->health <= 0.0f) {
-		ent->anim_state = DEATH;
-		ent->dead = true;
-		tint = DEAD_TINT;
+	if (c->health <= 0.0f) {
+		a->anim_state = DEATH;
+		c->dead = true;
 	}
 
 	// Switch the animation state
-	animator_switch_frame(&ent->animator, ent->anim_state);
+	animator_switch_frame(&a->animator, a->anim_state);
 
 	// If we are in attack state ie (is_swing_complete = false) and entity is alive
-	if (!ent->is_swing_complete && !ent->dead) {
-		AnimationEntry* entry = animator_get_entry(&ent->animator, ent->anim_state);
+	if (!c->is_swing_complete && !c->dead) {
+		AnimationEntry* entry = animator_get_entry(&a->animator, a->anim_state);
 
 		// Set (is_swing_complete = true) when the animation for the swing is complete
 		if (entry->curr_frame >= entry->frames.count - 1) {
-			ent->is_swing_complete = true;
+			c->is_swing_complete = true;
 		}
 	}
 
 	// Get the texture coords of current frame
-	ent->curr_frame = animator_get_frame(&ent->animator);
+	a->curr_frame = animator_get_frame(&a->animator);
+
+	// Fading the dash ghosts, longer trails fade faster
+	d->dash_ghost_alpha -= DASH_GHOST_ALPHA_RATE * char_dash_ghosts(es, e) * dt;
+
+	if (c->swing_flash > 0.0f)
+		c->swing_flash -= SWING_FLASH_RATE * dt;
+}
+
+i32 char_dash_ghosts(EntityStore* es, u32 e) {
+	Transform* t = &es->transform[e];
+	Dash* d = &es->dash[e];
+
+	f32 step = t->rect.w + 5;
+	return ceilf(fabsf(d->dash_end_pos.x - d->dash_start_pos.x) / step);
+}
+
+void char_render(EntityStore* es, u32 e, IMR* imr, f32 alpha) {
+	Transform* t = &es->transform[e];
+	Motion* m = &es->motion[e];
+	Combat* c = &es->combat[e];
+	Dash* d = &es->dash[e];
+	Anim* a = &es->anim[e];
+	Sprite* r = &es->sprite[e];
+
+	u32 palette_row = c->dead ? r->dead_palette_row : r->palette_row;
+	v3 pos = entity_lerp_pos(es, e, alpha);
 
 	// Handling player rotation
 	m4 rot = rotate_y(0);
-	switch(ent->face) {
+	switch(m->face) {
 		case LEFT:
 			rot = rotate_y(PI);
 			break;
@@ -932,194 +1466,244 @@ skip_movement_state:
 
 	// If hit apply the hit overlay
 	v4 overlay = { 0 };
-	if (ent->hit) {
+	if (c->hit) {
 		overlay = HIT_OVERLAY;
 	}
 
 	// Rendering dash effect
-	f32 step;
-	v2 size;
+	f32 step = t->rect.w + 5;
 	m4 dash_rot = rotate_y(0);
-
-	// Calculating the size and step of the dash
-	if (ent->face_during_dash == RIGHT) {
-		size = (v2) {
-			ent->dash_end_pos.x - ent->dash_start_pos.x,
-			ent->size.y
-		};
-
-		step = ent->rect.w + 5;
-		dash_rot = rotate_y(0);
-	} else {
-		size = (v2) {
-			ent->dash_start_pos.x - ent->dash_end_pos.x,
-			ent->size.y
-		};
-
-		step = - (ent->rect.w + 5);
+	if (d->face_during_dash == LEFT) {
+		step = -step;
 		dash_rot = rotate_y(PI);
 	}
-	
-	// Rendering the ghost sprite
-	for (
-		f32 x = ent->dash_start_pos.x;
-		(step > 0) ? (x < ent->dash_end_pos.x) : (x > ent->dash_end_pos.x);
-		x += step
-	) {
-		v3 pos = {
-			x,
-			ent->dash_start_pos.y,
-			0
-		};
 
-		imr_push_quad_tex(
+	// Rendering the ghost sprites, every one a bit more transparent than the last
+	i32 ghosts = char_dash_ghosts(es, e);
+	for (i32 i = 0; i < ghosts; i++) {
+		f32 ghost_alpha = d->dash_ghost_alpha - i * DASH_GHOST_ALPHA_STEP;
+		if (ghost_alpha <= 0.0f) break;
+
+		imr_push_quad_tex_palette(
 			imr,
-			pos,
-			ent->size,
-			ent->frame_during_dash,
-			ent->texture.id,
+			(v3) { d->dash_start_pos.x + i * step, d->dash_start_pos.y, 0 },
+			t->size,
+			d->frame_during_dash,
+			r->texture.id,
+			palette_row,
 			dash_rot,
-			(v4) { tint.r, tint.g, tint.b, ent->dash_ghost_alpha }
+			(v4) { 1, 1, 1, ghost_alpha },
+			(v4) { 0 }
 		);
-
-		// Decreasing the alpha for every render
-		// This is done inside of the forloop to have variadic alpha for each dash ghost
-		ent->dash_ghost_alpha -= DASH_GHOST_ALPHA_RATE;
 	}
 
 	// Rendering character sprite
-	imr_push_quad_tex_overlay(
+	imr_push_quad_tex_palette(
 		imr,
-		ent->pos,
-		ent->size,
-		ent->curr_frame,
-		ent->texture.id,
+		pos,
+		t->size,
+		a->curr_frame,
+		r->texture.id,
+		palette_row,
 		rot,
-		tint,
+		(v4) { 1, 1, 1, 1 },
 		overlay
 	);
 
-	// Debug collider render
-#ifdef RENDER_RECTS
-	Rect rect = entity_get_rect(ent);
-	imr_push_quad(
-		imr,
-		(v3) { rect.x, rect.y, 0.0f },
-		(v2) { rect.w, rect.h },
-		rotate_x(0),
-		(v4) {1,0,0,0.5f}
+	// Debug collider, hitbox and state
+	debug_rect(DEBUG_COLLIDERS, rect_with_offset((v2) { pos.x, pos.y }, t->rect), (v4) { 1, 0, 0, 0.5f });
+	debug_rect(DEBUG_HITBOXES, char_get_hitbox(es, e), (v4) { 1, 1, 0, 0.5 });
+	debug_text(
+		DEBUG_LABELS,
+		(v2) { pos.x + t->rect.x, pos.y + t->rect.y - 14 },
+		2,
+		(v4) { 1, 1, 1, 1 },
+		"HP %.0f VX %.0f", c->health, es->kin.vel_x[e]
 	);
-#endif
+}
+
+void char_render_light(EntityStore* es, u32 e, Lighting* lighting, IMR* imr) {
+	Combat* c = &es->combat[e];
+
+	if (c->swing_flash <= 0.0f) return;
+
+	// Flash of the sword swing over the hitbox
+	Rect hitbox = char_get_hitbox(es, e);
+	v2 center = {
+		hitbox.x + hitbox.w / 2,
+		hitbox.y + hitbox.h / 2
+	};
+	lighting_push(lighting, imr, center, SWING_FLASH_RADIUS * c->swing_flash, SWING_LIGHT);
 }
 
 // :player impl
-Entity* player_new(SpriteManager* sm) {
-	Entity* ent = mem_alloc(sizeof(Entity));
-
-	ent->pos = (v3) { 100, 600 - CHAR_RECT.h, 0 };
-	ent->size = CHAR_SIZE;
-	ent->rect = CHAR_RECT;
-	ent->texture = sm->sprites[E_SAMURAI];
-	ent->animator = sm->animators[E_SAMURAI];
-	ent->face = RIGHT;
-	ent->health = 100.0f;
-	ent->dash_ghost_alpha = DASH_GHOST_ALPHA;
-
-	return ent;
+Handle player_new(EntityStore* es, SpriteManager* sm) {
+	return char_new(es, sm, (v2) { 100, 600 - CHAR_RECT.h }, RIGHT, sm->player_row);
 }
 
-void player_controller(Entity* ent, Event event) {
+void player_controller(EntityStore* es, u32 e, Event event) {
+	Motion* m = &es->motion[e];
+	Combat* c = &es->combat[e];
+	Dash* d = &es->dash[e];
+
 	if (event.type == KEYDOWN) {
 		switch (event.e.key) {
 			case GLFW_KEY_W:
-				ent->move[UP] = true;
+				m->move[UP] = true;
 				break;
 			case GLFW_KEY_A:
-				ent->move[LEFT] = true;
+				m->move[LEFT] = true;
 				break;
 			case GLFW_KEY_D:
-				ent->move[RIGHT] = true;
+				m->move[RIGHT] = true;
 				break;
 			case GLFW_KEY_SPACE:
-				ent->try_dash = true;
+				d->try_dash = true;
 				break;
 		}
 	}
 	else if (event.type == KEYUP) {
 		switch (event.e.key) {
 			case GLFW_KEY_W:
-				ent->move[UP] = false;
+				m->move[UP] = false;
 				break;
 			case GLFW_KEY_A:
-				ent->move[LEFT] = false;
+				m->move[LEFT] = false;
 				break;
 			case GLFW_KEY_D:
-				ent->move[RIGHT] = false;
+				m->move[RIGHT] = false;
 				break;
 		}
 	}
 	else if (event.type == MOUSE_BUTTON_DOWN) {
 		if (event.e.button == MOUSE_BUTTON_LEFT) {
-			ent->try_atk = true;
+			c->try_atk = true;
 		}
 	}
 	else if (event.type == MOUSE_BUTTON_UP) {
 		if (event.e.button == MOUSE_BUTTON_LEFT) {
-			ent->try_atk = false;
+			c->try_atk = false;
+		}
+	}
+}
+
+void player2_controller(EntityStore* es, u32 e, Event event) {
+	Motion* m = &es->motion[e];
+	Combat* c = &es->combat[e];
+	Dash* d = &es->dash[e];
+
+	if (event.type == KEYDOWN) {
+		switch (event.e.key) {
+			case GLFW_KEY_UP:
+				m->move[UP] = true;
+				break;
+			case GLFW_KEY_LEFT:
+				m->move[LEFT] = true;
+				break;
+			case GLFW_KEY_RIGHT:
+				m->move[RIGHT] = true;
+				break;
+			case GLFW_KEY_RIGHT_SHIFT:
+				d->try_dash = true;
+				break;
+			case GLFW_KEY_RIGHT_CONTROL:
+				c->try_atk = true;
+				break;
+		}
+	}
+	else if (event.type == KEYUP) {
+		switch (event.e.key) {
+			case GLFW_KEY_UP:
+				m->move[UP] = false;
+				break;
+			case GLFW_KEY_LEFT:
+				m->move[LEFT] = false;
+				break;
+			case GLFW_KEY_RIGHT:
+				m->move[RIGHT] = false;
+				break;
+			case GLFW_KEY_RIGHT_CONTROL:
+				c->try_atk = false;
+				break;
 		}
 	}
 }
 
-void player_update(Entity* ent, Entity* enemy, Rect* rects, i32 rects_cnt, f64 dt) {
-	if (ent->dead) goto skip_movement;
+// :enemy impl
+Handle enemy_new(EntityStore* es, SpriteManager* sm, Handle target) {
+	Handle entity = char_new(es, sm, (v2) { 800, 600 - CHAR_RECT.h }, LEFT, sm->enemy_row);
+	es->brain[entity_index(es, entity)] = (Brain) { .ai = true, .target = target };
+	return entity;
+}
 
-	char_handle_atk(ent, enemy);
-	char_handle_dash(ent, dt);
+void enemy_spawn_wave(EntityStore* es, SpriteManager* sm, Handle target, Tilemap* level, CollisionWorld* world) {
+	if (es->slots.count + WAVE_SIZE > es->slots.capacity) {
+		log_warn("No room for another wave, %d entities already\n", es->slots.count);
+		return;
+	}
 
-	// Movement handling
-	physics_movement(ent, dt);
+	v3 center = es->transform[entity_index(es, target)].pos;
+	f32 level_width = level->width * level->tile_size;
 
-skip_movement:
-	char_handle_hit(ent);
+	for (i32 i = 0; i < WAVE_SIZE; i++) {
+		f32 offset = rand_range(0, (i32) (2 * WAVE_SPREAD)) - WAVE_SPREAD;
 
-	// Physics updating
-	physics_compute(ent, dt);
-	physics_resolve(ent, rects, rects_cnt, dt);
-}
+		// Keeping the bodies inside the level, past its edges there is no floor
+		v2 pos = { center.x + offset, center.y };
+		pos.x = fmaxf(pos.x, -CHAR_RECT.x);
+		pos.x = fminf(pos.x, level_width - CHAR_RECT.x - CHAR_RECT.w);
 
-// :enemy impl
-Entity* enemy_new(SpriteManager* sm) {
-	Entity* ent = mem_alloc(sizeof(Entity));
-
-	ent->pos = (v3) { 800, 600 - CHAR_RECT.h, 0 };
-	ent->size = CHAR_SIZE;
-	ent->rect = CHAR_RECT;
-	ent->texture = sm->sprites[E_SAMURAI];
-	ent->animator = sm->animators[E_SAMURAI];
-	ent->face = LEFT;
-	ent->health = 100.0f;
-	ent->dash_ghost_alpha = DASH_GHOST_ALPHA;
-
-	return ent;
+		// And out of the walls, the spawn is dropped rather than pushed somewhere else
+		Rect body = rect_with_offset(pos, CHAR_RECT);
+		body = (Rect) {
+			body.x + COLLISION_SKIN,
+			body.y + COLLISION_SKIN,
+			body.w - 2 * COLLISION_SKIN,
+			body.h - 2 * COLLISION_SKIN,
+		};
+		u32 blocked_cnt;
+		collision_world_query(world, body, &blocked_cnt);
+		if (blocked_cnt) continue;
+
+		Handle entity = enemy_new(es, sm, target);
+		entity_teleport(es, entity_index(es, entity), pos);
+
+		// Unlike the duel the wave doesnt leave its dead around
+		es->combat[entity_index(es, entity)].despawn_timeout = CORPSE_TIMEOUT;
+	}
 }
 
-void enemy_update(Entity* ent, Entity* player, Rect* rects, i32 rects_cnt, f64 dt) {
+void enemy_think(EntityStore* es, u32 e, f64 dt) {
+	Transform* t = &es->transform[e];
+	Motion* m = &es->motion[e];
+	Combat* c = &es->combat[e];
+	Dash* d = &es->dash[e];
+	u32 target = slot_map_index(&es->slots, es->brain[e].target);
+
 	// If dead dont update
-	if (ent->dead) goto skip_movement;
+	if (c->dead) return;
+
+	// Standing still once the target is gone
+	if (target == DENSE_NULL) {
+		c->try_atk = c->do_consec_atk = false;
+		m->move[UP] = m->move[LEFT] = m->move[RIGHT] = false;
+		return;
+	}
+	Transform* player = &es->transform[target];
 
 	// If the enemy is doing consecutive attack
 	// Do not chase the player
-	if (ent->do_consec_atk) {
+	if (c->do_consec_atk) {
 
 		// Stopping every movement when doing consecutive attack
-		ent->try_atk = true;
-		ent->move[UP] = ent->move[LEFT] = ent->move[RIGHT] = false;
-		if (ent->consec_atk >= MAX_CONSEC_ATK) {
-			ent->do_consec_atk = false;
+		c->try_atk = true;
+		m->move[UP] = m->move[LEFT] = m->move[RIGHT] = false;
+		if (c->consec_atk >= MAX_CONSEC_ATK) {
+			c->do_consec_atk = false;
 
 			// Enemy just completed its consecutive attack
 			// So giving it some attack cooldown
-			ent->atk_cooldown = ENEMY_ATK_COOLDOWN;
+			c->atk_cooldown = ENEMY_ATK_COOLDOWN;
 		}
 
 		// Skip the running and chasing part
@@ -1127,23 +1711,23 @@ void enemy_update(Entity* ent, Entity* player, Rect* rects, i32 rects_cnt, f64 d
 	} else {
 
 		// Do not attack if the consec attack is not enabled
-		ent->try_atk = false;
+		c->try_atk = false;
 	}
 
 	// Only facing when we arent doing consecutive attacks
 	// Make enemy face the player
-	if (player->pos.x < ent->pos.x) {
-		ent->face = LEFT;
+	if (player->pos.x < t->pos.x) {
+		m->face = LEFT;
 	}
-	else if (player->pos.x > ent->pos.x) {
-		ent->face = RIGHT;
+	else if (player->pos.x > t->pos.x) {
+		m->face = RIGHT;
 	}
 
 	// During cooldown enemy cannot attack
 	// So logic that handles enemy doing whatever the fk it does when it cannot attack
 	// GOES HERE
-	if (ent->atk_cooldown > 0.0f) {
-		f32 player_enemy_dist = fabsf(player->pos.x - ent->pos.x);
+	if (c->atk_cooldown > 0.0f) {
+		f32 player_enemy_dist = fabsf(player->pos.x - t->pos.x);
 
 		// If player is way closer to the enemy then dash away
 		if (player_enemy_dist < IN_PLAYER_HITZONE) {
@@ -1152,36 +1736,36 @@ void enemy_update(Entity* ent, Entity* player, Rect* rects, i32 rects_cnt, f64 d
 			// Only dash for certain probability
 			if (chance < ENEMY_DASH_PROBABILITY) {
 				// This helps the enemy to dash where there is more space
-				if ((ent->pos.x - 0) > (WIN_WIDTH - ent->pos.x)) {
+				if ((t->pos.x - 0) > (WIN_WIDTH - t->pos.x)) {
 					// Dash to left
-					ent->face = LEFT;
-					ent->try_dash = true;
+					m->face = LEFT;
+					d->try_dash = true;
 				} else {
 					// Dash to right
-					ent->face = RIGHT;
-					ent->try_dash = true;
+					m->face = RIGHT;
+					d->try_dash = true;
 				}
 			}
 		}
 
 		// If player is too close then just run the opposite direction
 		if (player_enemy_dist < PLAYER_TOO_CLOSE) {
-			if (player->pos.x < ent->pos.x) {
-				ent->move[LEFT] = false;
-				ent->move[RIGHT] = true;
+			if (player->pos.x < t->pos.x) {
+				m->move[LEFT] = false;
+				m->move[RIGHT] = true;
 			} else {
-				ent->move[LEFT] = true;
-				ent->move[RIGHT] = false;
+				m->move[LEFT] = true;
+				m->move[RIGHT] = false;
 			}
 		} else {
 			// If the player isnt in the range just stop mate
-			ent->move[LEFT] = ent->move[RIGHT] = false;
+			m->move[LEFT] = m->move[RIGHT] = false;
 		}
 
 		// Droping the cooldown so that enemy can attack again
-		ent->atk_cooldown -= ENEMY_ATK_COOLDOWN_RATE;
-		if (ent->atk_cooldown <= 0.0f)
-			ent->atk_cooldown = 0.0f;
+		c->atk_cooldown -= ENEMY_ATK_COOLDOWN_RATE * dt;
+		if (c->atk_cooldown <= 0.0f)
+			c->atk_cooldown = 0.0f;
 
 		// Do not chase when you cannot hit
 		goto skip_chasing;
@@ -1190,65 +1774,83 @@ void enemy_update(Entity* ent, Entity* player, Rect* rects, i32 rects_cnt, f64 d
 	// Enemy Chasing
 
 	// When player is on the left side
-	if (player->pos.x < ent->pos.x) {
-		ent->face = LEFT;
+	if (player->pos.x < t->pos.x) {
+		m->face = LEFT;
 		// Move within the hitrange
-		if (ent->pos.x - player->pos.x > HIT_RANGE) {
-			ent->move[RIGHT] = false;
-			ent->move[LEFT] = true;
+		if (t->pos.x - player->pos.x > HIT_RANGE) {
+			m->move[RIGHT] = false;
+			m->move[LEFT] = true;
 		} else {
-			ent->move[LEFT] = false;
+			m->move[LEFT] = false;
 		}
 	}
 	// When player is on the right side
-	else if (player->pos.x > ent->pos.x) {
-		ent->face = RIGHT;
+	else if (player->pos.x > t->pos.x) {
+		m->face = RIGHT;
 		// Move within the hitrange
-		if (player->pos.x - ent->pos.x > HIT_RANGE) {
-			ent->move[LEFT] = false;
-			ent->move[RIGHT] = true;
+		if (player->pos.x - t->pos.x > HIT_RANGE) {
+			m->move[LEFT] = false;
+			m->move[RIGHT] = true;
 		} else {
-			ent->move[RIGHT] = false;
+			m->move[RIGHT] = false;
 		}
 	}
 
 	// If the player is in the sky you shall too
-	if ((ent->pos.x - player->pos.x < HIT_RANGE) ||
-		 (player->pos.x - ent->pos.x < HIT_RANGE)) {
-		if (player->pos.y < ent->pos.y) {
-			ent->move[UP] = true;
+	if ((t->pos.x - player->pos.x < HIT_RANGE) ||
+		 (player->pos.x - t->pos.x < HIT_RANGE)) {
+		if (player->pos.y < t->pos.y) {
+			m->move[UP] = true;
 		} else {
-			ent->move[UP] = false;
+			m->move[UP] = false;
 		}
 	}
 
 skip_chasing:
 
 	// If player is alive and inside of hitbox ATTACK
-	Rect hitbox = char_get_hitbox(ent);
-	Rect p_rect = entity_get_rect(player);
-	if (rect_intersect_inclusive(hitbox, p_rect) && !player->dead) {
-		if (!ent->do_consec_atk && ent->consec_atk == 0 && ent->atk_cooldown == 0.0f) {
-			ent->do_consec_atk = true;
+	Rect hitbox = char_get_hitbox(es, e);
+	Rect p_rect = transform_rect(player);
+	if (rect_intersect_inclusive(hitbox, p_rect) && !es->combat[target].dead) {
+		if (!c->do_consec_atk && c->consec_atk == 0 && c->atk_cooldown == 0.0f) {
+			c->do_consec_atk = true;
 		}
 	}
+}
+
+// :ui impl
+void render_player_hud(IMR* imr, EntityStore* es, Handle player_entity) {
+	u32 player = entity_index(es, player_entity);
 
-	char_handle_atk(ent, player);
-	char_handle_dash(ent, dt);
+	render_progress_bar(imr, (v3) { 10, 10, 0 }, HEALTH_BAR_SIZE, es->combat[player].health, 100.0f, PLAYER_TINT);
+	render_progress_bar(imr, (v3) { 10, 40, 0 }, COOLDOWN_BAR_SIZE, DASH_COOLDOWN - es->dash[player].dash_cooldown, DASH_COOLDOWN, PLAYER_TINT);
+	render_progress_bar(imr, (v3) { 10, 60, 0 }, COOLDOWN_BAR_SIZE, MAX_CONSEC_ATK - es->combat[player].consec_atk, MAX_CONSEC_ATK, PLAYER_TINT);
+}
 
-	// Movement handling
-	physics_movement(ent, dt);
+void render_hud(IMR* imr, EntityStore* es, Handle enemy_entity) {
+	u32 enemy = entity_index(es, enemy_entity);
 
-skip_movement:
-	char_handle_hit(ent);
+	render_progress_bar(imr, (v3) { WIN_WIDTH - 210, 10, 0 }, HEALTH_BAR_SIZE, es->combat[enemy].health, 100.0f, ENEMY_TINT);
 
-	physics_compute(ent, dt);
-	physics_resolve(ent, rects, rects_cnt, dt);
+	// Split screen divider
+	if (split_screen) {
+		imr_push_quad(
+			imr,
+			(v3) { WIN_WIDTH / 2 - 2, 0, 0 },
+			(v2) { 4, WIN_HEIGHT },
+			rotate_x(0),
+			(v4) { 0, 0, 0, 1 }
+		);
+	}
+}
+
+i32 progress_bar_length(v2 size, f32 val, f32 max) {
+	i32 length = roundf(val / max * size.x);
+	return length < 0 ? 0 : length;
 }
 
-// :ui impl
 void render_progress_bar(IMR* imr, v3 pos, v2 size, f32 val, f32 max, v4 color) {
-	f32 length = val / max * size.x;
+	f32 length = progress_bar_length(size, val, max);
 	imr_push_quad(
 		imr,
 		pos,
@@ -1258,16 +1860,88 @@ void render_progress_bar(IMR* imr, v3 pos, v2 size, f32 val, f32 max, v4 color)
 	);
 }
 
+// :background impl
+void background_mountains(IMR* imr, u32 width, u32 height, void* data) {
+	static const f32 peaks[] = { 0.45f, 0.3f, 0.55f, 0.35f, 0.5f, 0.25f, 0.4f, 0.3f };
+	i32 peaks_cnt = sizeof(peaks) / sizeof(peaks[0]);
+	f32 spacing = (f32) width / peaks_cnt;
+
+	for (i32 i = 0; i < peaks_cnt; i++) {
+		f32 x = i * spacing;
+		f32 y = peaks[i] * height;
+
+		// Also drawn one width to each side so that the edges wrap seamlessly
+		for (i32 wrap = -1; wrap <= 1; wrap++) {
+			f32 wx = x + wrap * (f32) width;
+			imr_push_triangle(
+				imr,
+				(v3) { wx - spacing, height, 0 },
+				(v3) { wx, y, 0 },
+				(v3) { wx + spacing, height, 0 },
+				rotate_x(0),
+				(v4) { 0.35f, 0.38f, 0.45f, 1 }
+			);
+		}
+	}
+}
+
+void background_pillars(IMR* imr, u32 width, u32 height, void* data) {
+	static const f32 heights[] = { 0.5f, 0.65f, 0.4f, 0.6f, 0.45f };
+	i32 pillars_cnt = sizeof(heights) / sizeof(heights[0]);
+	f32 spacing = (f32) width / pillars_cnt;
+
+	// Pillars are narrower than the spacing, so none of them crosses the edge
+	for (i32 i = 0; i < pillars_cnt; i++) {
+		f32 h = heights[i] * height;
+		imr_push_quad(
+			imr,
+			(v3) { i * spacing + spacing / 4, height - h, 0 },
+			(v2) { spacing / 4, h },
+			rotate_x(0),
+			(v4) { 0.25f, 0.25f, 0.28f, 1 }
+		);
+		imr_push_quad(
+			imr,
+			(v3) { i * spacing + spacing / 4 - 10, height - h, 0 },
+			(v2) { spacing / 4 + 20, 20 },
+			rotate_x(0),
+			(v4) { 0.22f, 0.22f, 0.25f, 1 }
+		);
+	}
+}
+
 // :main
-int main() {
+int main(int argc, char** argv) {
 	rand_init(time(NULL));
 
+	// :args
+	const char* capture_path = NULL;
+	const char* level_path = NULL;
+	const char* save_level_path = NULL;
+	u32 sim_rate = SIM_RATE;
+	for (i32 i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--capture") && i + 1 < argc) {
+			capture_path = argv[++i];
+		} else if (!strcmp(argv[i], "--level") && i + 1 < argc) {
+			level_path = argv[++i];
+		} else if (!strcmp(argv[i], "--save-level") && i + 1 < argc) {
+			save_level_path = argv[++i];
+		} else if (!strcmp(argv[i], "--sim-rate") && i + 1 < argc) {
+			// Lower on weak devices, the motion doesnt depend on it
+			sim_rate = atoi(argv[++i]);
+			if (sim_rate == 0) sim_rate = SIM_RATE;
+		} else {
+			log_warn("Unknown argument: %s\n", argv[i]);
+		}
+	}
+
 	Window window = window_new("Combat", WIN_WIDTH, WIN_HEIGHT);
 
 	printf("Opengl Version: %s\n", glGetString(GL_VERSION));
 
-	IMR imr = imr_new();
+	IMR imr = imr_new(IMR_CONFIG_DEFAULT);
 	FrameController fc = frame_controller_new(FPS);
+	FixedStep step = fixed_step_new(sim_rate, MAX_TICKS_PER_FRAME);
 	OCamera camera = ocamera_new(
 		(v2) {0,0},
 		1,
@@ -1280,23 +1954,115 @@ int main() {
 			.far = 1000.0f,
 		}
 	);
+	// Split screen cameras, each one follows a player over half of the window
+	OCamera_Boundary half_boundary = {
+		.left = 0,
+		.right = WIN_WIDTH / 2,
+		.top = 0,
+		.bottom = WIN_HEIGHT,
+		.near = -1.0f,
+		.far = 1000.0f,
+	};
+	OCamera split_cameras[2] = {
+		ocamera_new((v2) {0,0}, 1, half_boundary),
+		ocamera_new((v2) {0,0}, 1, half_boundary),
+	};
+
+	texture_set_vram_budget(VRAM_BUDGET);
 	SpriteManager sm = load_sprites();
+	Overdraw overdraw = overdraw_new(WIN_WIDTH, WIN_HEIGHT);
+	Lighting lighting = lighting_new(WIN_WIDTH, WIN_HEIGHT, AMBIENT_LIGHT);
+	RenderScale render_scale = render_scale_new(WIN_WIDTH, WIN_HEIGHT, GPU_FRAME_TARGET_MS);
+
+	// Player hud, redrawn only when the bars change
+	UILayer ui = ui_layer_new(PLAYER_HUD_RECT, (v2) { WIN_WIDTH, WIN_HEIGHT });
+
+	// Background layers, composed once and scrolled with the camera
+	Parallax parallax = parallax_new();
+	parallax_add_layer(&parallax, BACKGROUND_WIDTH, WIN_HEIGHT, MOUNTAINS_FACTOR, background_mountains, NULL);
+	parallax_add_layer(&parallax, BACKGROUND_WIDTH, WIN_HEIGHT, PILLARS_FACTOR, background_pillars, NULL);
+
+	// Last composited frame, shown again while idle
+	FBO idle_frame = fbo_new(WIN_WIDTH, WIN_HEIGHT);
+	b32 idle_frame_valid = false;
+	log_info("Textures use %.2f MB of vram\n", texture_vram_used() / (1024.0 * 1024.0));
+
+	// Recording the imr stream so that it can be replayed by the replay tool
+	IMR_Capture* capture = NULL;
+	if (capture_path) {
+		capture = imr_capture_new(capture_path, WIN_WIDTH, WIN_HEIGHT);
+		imr_capture_texture(capture, imr.white);
+		imr_capture_texture(capture, sm.palette.texture);
+		for (i32 i = 0; i < ENTITY_CNT; i++)
+			imr_capture_texture(capture, sm.sprites[i]);
+		ctx->capture = capture;
+		log_info("Capturing imr stream to: %s\n", capture_path);
+	}
+	imr_set_palette(&imr, &sm.palette);
 
 	b32 pause = false;
 
-	// Set renderer to context for debug rendering
-	ctx->inner = &imr;
+	// Debug geometry is drawn on its own after the frame
+	DebugDraw debug = debug_draw_new();
+	ctx->debug = &debug;
 
 	// Characters
-	Entity* player = player_new(&sm);
-	Entity* enemy = enemy_new(&sm);
+	EntityStore es = entity_store_new(MAX_ENTITIES);
+	Handle player = player_new(&es, &sm);
+	Handle enemy = enemy_new(&es, &sm, player);
+
+	// Level, either streamed from a file or a floor between two walls
+	Tilemap level;
+	LevelStream* stream = NULL;
+	if (level_path) {
+		stream = level_stream_open(level_path, &level, LEVEL_STREAM_RADIUS);
+		es.stream = stream;
+
+		// Every spawn is placed upfront, the first enemy spawn takes the duel enemy and the
+		// others get one each. Those away from the views wait frozen for their chunks.
+		b32 enemy_placed = false;
+		LevelSpawn spawn;
+		while (level_stream_poll_spawn(stream, &spawn)) {
+			if (spawn.kind == SPAWN_PLAYER) {
+				entity_teleport(&es, entity_index(&es, player), spawn.pos);
+			} else if (spawn.kind == SPAWN_ENEMY) {
+				if (enemy_placed && es.slots.count == es.slots.capacity) {
+					log_warn("Dropping level spawns, the entity store is full\n");
+					break;
+				}
+				Handle entity = enemy_placed ? enemy_new(&es, &sm, player) : enemy;
+				entity_teleport(&es, entity_index(&es, entity), spawn.pos);
+				enemy_placed = true;
+			}
+		}
+	} else {
+		level = tilemap_new(LEVEL_WIDTH, LEVEL_HEIGHT, TILE_SIZE);
+		tilemap_fill(&level, 0, 70, LEVEL_WIDTH, 10, TILE_STONE);
+		tilemap_fill(&level, 0, 0, 5, LEVEL_HEIGHT, TILE_STONE);
+		tilemap_fill(&level, LEVEL_WIDTH - 5, 0, 5, LEVEL_HEIGHT, TILE_STONE);
+	}
+	tilemap_set_color(&level, TILE_STONE, STONE_COLOR);
+	CollisionWorld world = collision_world_new();
+
+	if (save_level_path && stream) {
+		log_warn("A streamed level cannot be saved\n");
+	} else if (save_level_path) {
+		v3 player_pos = es.transform[entity_index(&es, player)].pos;
+		v3 enemy_pos = es.transform[entity_index(&es, enemy)].pos;
+		LevelSpawn spawns[] = {
+			{ SPAWN_PLAYER, { player_pos.x, player_pos.y } },
+			{ SPAWN_ENEMY, { enemy_pos.x, enemy_pos.y } },
+		};
+		if (level_save(&level, spawns, sizeof(spawns) / sizeof(spawns[0]), save_level_path))
+			log_info("Saved level to: %s\n", save_level_path);
+	}
+	v2 mouse_pos = {0};
 
-	Rect rects[] = {
-		{ 0, 700, WIN_WIDTH, 100 },
-		{ 0, 0, 50, WIN_HEIGHT },
-		{ WIN_WIDTH - 50, 0, 50, WIN_HEIGHT },
+	v2 torches[] = {
+		{ 75, 450 },
+		{ WIN_WIDTH - 75, 450 },
 	};
-	i32 rects_cnt = sizeof(rects) / sizeof(rects[0]);
+	i32 torches_cnt = sizeof(torches) / sizeof(torches[0]);
 
 	// :loop
 	while (!window.should_close) {
@@ -1305,65 +2071,249 @@ int main() {
 		// :event
 		Event event = {0};
 		while (event_poll(window, &event)) {
-			player_controller(player, event);
+			if (event.type != MOUSE_MOTION) idle_frame_valid = false;
+			if (event.type == MOUSE_MOTION) mouse_pos = event.e.mouse_pos;
+
+			// Mouse 1 edits the level instead of attacking
+			if (edit_tiles && event.type == MOUSE_BUTTON_DOWN && event.e.button == MOUSE_BUTTON_LEFT) {
+				Rect view = ocamera_view_rect(&camera);
+				v2 local = mouse_pos;
+				if (split_screen) {
+					i32 half = mouse_pos.x >= WIN_WIDTH / 2;
+					view = ocamera_view_rect(&split_cameras[half]);
+					local.x -= half * WIN_WIDTH / 2;
+				}
+
+				i32 x, y;
+				if (tilemap_pick(&level, (v2) { view.x + local.x, view.y + local.y }, &x, &y))
+					tilemap_set(&level, x, y, tilemap_get(&level, x, y) == TILE_EMPTY ? TILE_STONE : TILE_EMPTY);
+				continue;
+			}
+
+			player_controller(&es, entity_index(&es, player), event);
+			if (split_screen) player2_controller(&es, entity_index(&es, enemy), event);
 
 			if (event.type == MOUSE_BUTTON_DOWN) {
 				if (event.e.button == MOUSE_BUTTON_RIGHT) {
-					enemy->try_atk = true;
+					es.combat[entity_index(&es, enemy)].try_atk = true;
 				}
 			}
 			else if (event.type == MOUSE_BUTTON_UP) {
 				if (event.e.button == MOUSE_BUTTON_RIGHT) {
-					enemy->try_atk = false;
+					es.combat[entity_index(&es, enemy)].try_atk = false;
 				}
 			}
 			else if (event.type == KEYDOWN) {
 				if (event.e.key == GLFW_KEY_ESCAPE) {
 					pause = !pause;
 				}
+				else if (event.e.key == GLFW_KEY_F1) {
+					render_overdraw = !render_overdraw;
+				}
+				else if (event.e.key == GLFW_KEY_F2) {
+					render_scaling = !render_scaling;
+				}
+				else if (event.e.key == GLFW_KEY_F3) {
+					split_screen = !split_screen;
+					es.brain[entity_index(&es, enemy)].ai = !split_screen;
+				}
+				else if (event.e.key == GLFW_KEY_F4) {
+					debug.enabled ^= DEBUG_COLLIDERS;
+				}
+				else if (event.e.key == GLFW_KEY_F5) {
+					debug.enabled ^= DEBUG_HITBOXES;
+				}
+				else if (event.e.key == GLFW_KEY_F6) {
+					debug.enabled ^= DEBUG_LABELS;
+				}
+				else if (event.e.key == GLFW_KEY_F7) {
+					edit_tiles = !edit_tiles;
+				}
+				else if (event.e.key == GLFW_KEY_F8) {
+					enemy_spawn_wave(&es, &sm, player, &level, &world);
+				}
 			}
 		}
 
+		// :idle
+		// Nothing is simulated while paused or unfocused, so the last frame is shown
+		// again at a low rate until an input invalidates it
+		b32 idle = pause || !window.focused;
+		frame_controller_set_idle(&fc, idle);
+		if (idle && idle_frame_valid) {
+			fbo_copy_to_target(&idle_frame);
+			window_update(&window);
+			frame_controller_end(&fc);
+			continue;
+		}
+
+		// The world is drawn at the adaptive scale while the ui stays at native resolution
+		// NOTE: Overdraw counts are taken at native resolution
+		b32 scaled = render_scaling && !render_overdraw;
+		parallax_update(&parallax, &imr);
+		if (scaled) render_scale_begin(&render_scale);
+
+		debug_draw_begin(&debug);
+
 		m4 mvp = ocamera_calc_mvp(&camera);
 		imr_update_mvp(&imr, mvp);
 		imr_clear((v4) { .5f, .5f, .5f, 1.0f });
 
+		if (render_overdraw) overdraw_begin(&overdraw, &imr);
+
+		// One vertex build of the world is drawn through both cameras
+		IMR_View views[2];
+		u32 views_cnt = 0;
+		if (split_screen) {
+			u32 followed[2] = { entity_index(&es, player), entity_index(&es, enemy) };
+			views_cnt = 2;
+			for (i32 i = 0; i < 2; i++) {
+				v3 lerp = entity_lerp_pos(&es, followed[i], step.alpha);
+				ocamera_follow(
+					&split_cameras[i],
+					rect_with_offset((v2) { lerp.x, lerp.y }, es.transform[followed[i]].rect),
+					(v2) { 0, 0 },
+					CAMERA_DELAY,
+					(v2) { WIN_WIDTH / 2, WIN_HEIGHT }
+				);
+				views[i] = (IMR_View) {
+					.mvp = ocamera_calc_mvp(&split_cameras[i]),
+					.viewport = { 0.5f * i, 0, 0.5f, 1 },
+				};
+			}
+		}
+
+		// :background
+		if (split_screen) {
+			for (i32 i = 0; i < 2; i++) {
+				IMR_View view = { ortho_screen_mvp(1, 1), views[i].viewport };
+				imr_set_views(&imr, &view, 1);
+				parallax_draw(&parallax, &imr, split_cameras[i].pos, (v2) { WIN_WIDTH / 2, WIN_HEIGHT });
+			}
+			imr_set_views(&imr, views, views_cnt);
+		} else {
+			parallax_draw(&parallax, &imr, camera.pos, (v2) { WIN_WIDTH, WIN_HEIGHT });
+		}
+
+		// What every view shows, entities past it are updated less
+		Rect view_rects[2] = { ocamera_view_rect(&camera) };
+		u32 view_rects_cnt = 1;
+		if (split_screen) {
+			view_rects[0] = ocamera_view_rect(&split_cameras[0]);
+			view_rects[1] = ocamera_view_rect(&split_cameras[1]);
+			view_rects_cnt = 2;
+		}
+		Rect view = view_rects[0];
+		if (split_screen)
+			view = rect_union(view_rects[0], view_rects[1]);
+		entity_store_set_focus(&es, view);
+
+		// :level
+		if (stream) {
+			// Keeping the chunks around every view resident, not the ones between them
+			level_stream_update(stream, view_rects, view_rects_cnt);
+		}
+
+		// Every view only draws the chunks it can see
+		if (split_screen) {
+			for (i32 i = 0; i < 2; i++) {
+				imr_set_views(&imr, &views[i], 1);
+				tilemap_draw(&level, &imr, ocamera_view_rect(&split_cameras[i]));
+			}
+			imr_set_views(&imr, views, views_cnt);
+		} else {
+			tilemap_draw(&level, &imr, ocamera_view_rect(&camera));
+		}
+
+		// The collision world follows the level, only built again after it changed
+		b32 level_changed = level.rects_dirty;
+		i32 rects_cnt;
+		Rect* rects = tilemap_rects(&level, &rects_cnt);
+		if (level_changed) {
+			collision_world_build(&world, rects, rects_cnt);
+			entity_store_wake_all(&es);
+		}
+
 		imr_begin(&imr);
 
 		// :update
-		if (!pause) {
-			player_update(player, enemy, rects, rects_cnt, fc.dt);
-			enemy_update(enemy, player, rects, rects_cnt, fc.dt);
-		}
+		// The simulation runs in fixed ticks and the characters are drawn in between the last two
+		u32 ticks = idle ? 0 : fixed_step_advance(&step, fc.dt);
+		for (u32 tick = 0; tick < ticks; tick++)
+			entity_store_update(&es, &world, step.step);
 
 		// :render
 		{
-			char_render(player, &imr, PLAYER_TINT);
-			char_render(enemy, &imr, ENEMY_TINT);
-
-			for (i32 i = 0; i < rects_cnt; i++) {
-				Rect r = rects[i];
-				v3 pos = { r.x, r.y, 0 };
-				v2 size = { r.w, r.h };
-				imr_push_quad(
-					&imr,
-					pos,
-					size,
-					rotate_x(0),
-					(v4) { 0.1, 0.1, 0.1, 1 }
-				);
+			for (u32 e = 0; e < es.slots.count; e++)
+				char_render(&es, e, &imr, step.alpha);
+
+			if (debug_on(DEBUG_COLLIDERS)) {
+				for (i32 i = 0; i < rects_cnt; i++)
+					debug_draw_rect_lines(&debug, rects[i], (v4) { 0, 1, 0, 1 });
+			}
+		}
+
+		imr_end(&imr);
+
+		// :lighting
+		// NOTE: Light passes use their own blending so they are left out of the overdraw counts
+		if (!render_overdraw) {
+			lighting_begin(&lighting, &imr);
+
+			for (i32 i = 0; i < torches_cnt; i++) {
+				f32 flicker = sinf(glfwGetTime() * 10.0f + i) * TORCH_FLICKER;
+				lighting_push(&lighting, &imr, torches[i], TORCH_RADIUS + flicker, TORCH_LIGHT);
 			}
 
-			// Rendering ui stuff
-			render_progress_bar(&imr, (v3) { 10, 10, 0 }, (v2) { 200, 20 }, player->health, 100.0f, PLAYER_TINT);
-			render_progress_bar(&imr, (v3) { 10, 40, 0 }, (v2) { 200, 10 }, DASH_COOLDOWN - player->dash_cooldown, DASH_COOLDOWN, PLAYER_TINT);
-			render_progress_bar(&imr, (v3) { 10, 60, 0 }, (v2) { 200, 10 }, MAX_CONSEC_ATK - player->consec_atk, MAX_CONSEC_ATK, PLAYER_TINT);
+			for (u32 e = 0; e < es.slots.count; e++)
+				char_render_light(&es, e, &lighting, &imr);
+
+			lighting_end(&lighting, &imr);
+		}
+
+		// Fullscreen passes and the ui are drawn once over the whole target
+		imr_set_views(&imr, NULL, 0);
+
+		if (!render_overdraw) {
+			lighting_composite(&lighting, &imr);
+		}
 
-			render_progress_bar(&imr, (v3) { WIN_WIDTH - 210, 10, 0 }, (v2) { 200, 20 }, enemy->health, 100.0f, ENEMY_TINT);
+		if (scaled) {
+			render_scale_end();
+			render_scale_present(&render_scale, &imr);
 		}
 
+		// :ui
+		// NOTE: The hud cache uses its own blending, so it is drawn directly in overdraw mode
+		// The hud is in screen pixels
+		imr_update_mvp(&imr, ortho_screen_mvp(WIN_WIDTH, WIN_HEIGHT));
+		if (render_overdraw) {
+			imr_begin(&imr);
+			render_player_hud(&imr, &es, player);
+			render_hud(&imr, &es, enemy);
+			imr_end(&imr);
+		} else {
+			u32 p = entity_index(&es, player);
+			ui_layer_begin(&ui);
+			ui_layer_input(&ui, progress_bar_length(HEALTH_BAR_SIZE, es.combat[p].health, 100.0f));
+			ui_layer_input(&ui, progress_bar_length(COOLDOWN_BAR_SIZE, DASH_COOLDOWN - es.dash[p].dash_cooldown, DASH_COOLDOWN));
+			ui_layer_input(&ui, progress_bar_length(COOLDOWN_BAR_SIZE, MAX_CONSEC_ATK - es.combat[p].consec_atk, MAX_CONSEC_ATK));
+
+			if (ui_layer_redraw_begin(&ui, &imr)) {
+				render_player_hud(&imr, &es, player);
+				ui_layer_redraw_end(&ui, &imr);
+			}
+			ui_layer_present(&ui, &imr);
+
+			imr_begin(&imr);
+			render_hud(&imr, &es, enemy);
+			imr_end(&imr);
+		}
+		imr_update_mvp(&imr, mvp);
+
 		// :pause
 		if (pause) {
+			imr_begin(&imr);
 			imr_push_quad(
 				&imr,
 				(v3) {0},
@@ -1387,20 +2337,53 @@ int main() {
 				rotate_x(0),
 				(v4) { 1, 1, 1, 1 }
 			);
+			imr_end(&imr);
 		}
-		
-		imr_end(&imr);
+
+		if (render_overdraw) {
+			overdraw_end(&overdraw, &imr);
+			overdraw_present(&overdraw, &imr);
+		}
+
+		debug_draw_flush(&debug, mvp, views, views_cnt);
+
+		if (idle) {
+			fbo_copy_from_target(&idle_frame);
+			idle_frame_valid = true;
+		}
+
+		if (scaled) render_scale_update(&render_scale);
+		if (capture) imr_capture_frame(capture);
 
 		window_update(&window);
 		frame_controller_end(&fc);
 		// printf("FPS: %d\n", fc.fps);
+
+		// Reporting the overdraw once every second
+		if (render_overdraw && fc.frame == 0) {
+			log_info("Overdraw: avg %.2f max %d\n", overdraw.avg, overdraw.max);
+		}
 	}
 
 	// :clean
-	mem_free(player);
-	mem_free(enemy);
+	if (capture) {
+		log_info("Captured %d frames\n", capture->frames);
+		imr_capture_delete(capture);
+	}
+
+	entity_store_delete(&es);
 
 	delete_sprites(&sm);
+	overdraw_delete(&overdraw);
+	lighting_delete(&lighting);
+	render_scale_delete(&render_scale);
+	fbo_delete(&idle_frame);
+	parallax_delete(&parallax);
+	if (stream) level_stream_close(stream);
+	tilemap_delete(&level);
+	collision_world_delete(&world);
+	ui_layer_delete(&ui);
+	debug_draw_delete(&debug);
 	imr_delete(&imr);
 	window_delete(window);
 	return 0;
@@ -0,0 +1,355 @@
+#define BASE_IMPLEMENTATION
+#include "base.h"
+
+/*
+ * IMR replay tool
+ * Resubmits a stream recorded with `game --capture <file>` against the IMR
+ * and reports the cpu and gpu time of every captured frame.
+ *
+ * usage: replay <file> [--loops N]
+ */
+
+extern Context* ctx;
+
+// :const
+#define MAX_REPLAY_TEXTURES 64
+#define MAX_REPLAY_TARGETS  16
+#define MAX_REPLAY_FRAMES   100000
+
+// :replay def
+typedef struct {
+	u32 captured_id;
+	Texture texture;
+} ReplayTexture;
+
+typedef struct {
+	u32 captured_id;
+	FBO fbo;
+} ReplayTarget;
+
+typedef struct {
+	f64 cpu_ms;
+	f64 gpu_ms;
+	u32 draws;
+	u32 verts;
+} FrameStats;
+
+typedef struct {
+	u8* data;
+	size_t size;
+
+	ReplayTexture textures[MAX_REPLAY_TEXTURES];
+	u32 textures_cnt;
+
+	ReplayTarget targets[MAX_REPLAY_TARGETS];
+	u32 targets_cnt;
+
+	// Captured texture id resident in every slot
+	u32 slots[TEXTURE_SAMPLE_AMT];
+
+	FrameStats* frames;
+	u32 frames_cnt;
+	b32 warned_shader;
+	b32 warned_truncated;
+} Replay;
+
+IMR_Capture_Record* replay_next_record(Replay* replay, size_t* offset); // NULL at the end or on a truncated record
+void replay_load_textures(Replay* replay);
+void replay_bind_textures(Replay* replay);
+void replay_apply_target(Replay* replay, RenderTarget* target);
+void replay_run(Replay* replay, IMR* imr, Window* window);
+void replay_report(Replay* replay, u32 loops);
+
+// :replay impl
+IMR_Capture_Record* replay_next_record(Replay* replay, size_t* offset) {
+	if (*offset + sizeof(IMR_Capture_Record) > replay->size) return NULL;
+
+	// A capture cut short, by a crash for instance, ends with a partial record
+	IMR_Capture_Record* record = (IMR_Capture_Record*) (replay->data + *offset);
+	if (record->size > replay->size - *offset - sizeof(IMR_Capture_Record)) {
+		if (!replay->warned_truncated) {
+			log_warn("Capture is truncated at byte %zu, replaying up to there\n", *offset);
+			replay->warned_truncated = true;
+		}
+		return NULL;
+	}
+
+	*offset += sizeof(IMR_Capture_Record) + record->size;
+	return record;
+}
+
+void replay_load_textures(Replay* replay) {
+	size_t offset = 0;
+	IMR_Capture_Record* record;
+	while ((record = replay_next_record(replay, &offset))) {
+		u32* payload = (u32*) (record + 1);
+
+		if (record->type == IMR_CMD_TEXTURE) {
+			panic(replay->textures_cnt < MAX_REPLAY_TEXTURES, "Too many textures in the capture\n");
+			panic(
+				record->size >= 3 * sizeof(u32) && record->size - 3 * sizeof(u32) >= (u64) payload[1] * payload[2] * sizeof(u32),
+				"Corrupted texture in the capture\n"
+			);
+
+			replay->textures[replay->textures_cnt++] = (ReplayTexture) {
+				.captured_id = payload[0],
+				.texture = texture_from_data(payload[1], payload[2], payload + 3),
+			};
+		}
+
+		// Recreating the offscreen targets, their color textures are sampled by later passes
+		if (record->type == IMR_CMD_TARGET) {
+			RenderTarget* target = (RenderTarget*) payload;
+			if (!target->id) continue;
+
+			b32 exists = false;
+			for (u32 i = 0; i < replay->targets_cnt; i++)
+				exists |= replay->targets[i].captured_id == target->id;
+			if (exists) continue;
+
+			panic(replay->targets_cnt < MAX_REPLAY_TARGETS, "Too many targets in the capture\n");
+			panic(replay->textures_cnt < MAX_REPLAY_TEXTURES, "Too many textures in the capture\n");
+
+			FBO fbo = fbo_new(target->width, target->height);
+			replay->targets[replay->targets_cnt++] = (ReplayTarget) {
+				.captured_id = target->id,
+				.fbo = fbo,
+			};
+			replay->textures[replay->textures_cnt++] = (ReplayTexture) {
+				.captured_id = target->texture,
+				.texture = fbo.color_texture,
+			};
+		}
+	}
+}
+
+void replay_apply_target(Replay* replay, RenderTarget* target) {
+	RenderTarget mapped = { 0, 0, ctx->win_width, ctx->win_height };
+	for (u32 i = 0; i < replay->targets_cnt; i++) {
+		ReplayTarget* rt = &replay->targets[i];
+		if (rt->captured_id != target->id) continue;
+
+		mapped = (RenderTarget) {
+			rt->fbo.id,
+			rt->fbo.color_texture.id,
+			target->width,
+			target->height
+		};
+	}
+	fbo_apply_target(mapped);
+}
+
+void replay_bind_textures(Replay* replay) {
+	// The captured vertices refer to slots, binding whatever was resident in them
+	for (u32 slot = 0; slot < TEXTURE_SAMPLE_AMT; slot++) {
+		if (!replay->slots[slot]) continue;
+
+		for (u32 i = 0; i < replay->textures_cnt; i++) {
+			ReplayTexture* rt = &replay->textures[i];
+			if (rt->captured_id != replay->slots[slot]) continue;
+
+			GLCall(glActiveTexture(GL_TEXTURE0 + slot));
+			GLCall(glBindTexture(GL_TEXTURE_2D, rt->texture.id));
+		}
+	}
+}
+
+void replay_run(Replay* replay, IMR* imr, Window* window) {
+	u32 query;
+	GLCall(glGenQueries(1, &query));
+
+	u32 frame = 0;
+	FrameStats stats = {0};
+	f64 start = glfwGetTime();
+	GLCall(glBeginQuery(GL_TIME_ELAPSED, query));
+
+	size_t offset = 0;
+	IMR_Capture_Record* record;
+	while (!window->should_close && (record = replay_next_record(replay, &offset))) {
+		void* payload = record + 1;
+
+		switch (record->type) {
+			case IMR_CMD_CLEAR: {
+				imr_clear(*(v4*) payload);
+			} break;
+
+			case IMR_CMD_SHADER: {
+				// Custom shader sources are not part of the capture
+				u32* cmd = payload;
+				if (!cmd[1] && !replay->warned_shader) {
+					log_warn("Custom shader %d is replayed with the default shader\n", cmd[0]);
+					replay->warned_shader = true;
+				}
+				imr_switch_shader_to_default(imr);
+			} break;
+
+			case IMR_CMD_BLEND: {
+				u32* cmd = payload;
+				if (record->size == 4 * sizeof(u32))
+					imr_blend_separate(cmd[0], cmd[1], cmd[2], cmd[3]);
+				else
+					imr_blend(cmd[0], cmd[1]);
+			} break;
+
+			case IMR_CMD_TARGET: {
+				replay_apply_target(replay, payload);
+			} break;
+
+			case IMR_CMD_BIND: {
+				u32* cmd = payload;
+				if (cmd[0] < TEXTURE_SAMPLE_AMT) replay->slots[cmd[0]] = cmd[1];
+			} break;
+
+			case IMR_CMD_VIEWS: {
+				u32* cmd = payload;
+				panic(record->size >= sizeof(u32) + (u64) cmd[0] * sizeof(IMR_View), "Corrupted views in the capture\n");
+				imr_set_views(imr, (IMR_View*) (cmd + 1), cmd[0]);
+			} break;
+
+			case IMR_CMD_MVP: {
+				imr_update_mvp(imr, *(m4*) payload);
+			} break;
+
+			case IMR_CMD_DRAW: {
+				u32 count = record->size / sizeof(f32);
+				panic(count <= imr->max_cap, "Captured batch doesnt fit in the imr buffer\n");
+
+				imr_begin(imr);
+				imr_reserve(imr, count / VERTEX_SIZE);
+				replay_bind_textures(replay);
+				memcpy(imr->buffer, payload, record->size);
+				imr->buff_idx = count;
+				imr_end(imr);
+
+				stats.draws++;
+				stats.verts += count / VERTEX_SIZE;
+			} break;
+
+			case IMR_CMD_FRAME: {
+				stats.cpu_ms = (glfwGetTime() - start) * 1000.0;
+				GLCall(glEndQuery(GL_TIME_ELAPSED));
+
+				// Waiting for the gpu is fine here as we only care about the timings
+				GLuint64 elapsed = 0;
+				GLCall(glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed));
+				stats.gpu_ms = elapsed / 1000000.0;
+
+				if (frame < replay->frames_cnt) {
+					FrameStats* total = &replay->frames[frame];
+					total->cpu_ms += stats.cpu_ms;
+					total->gpu_ms += stats.gpu_ms;
+					total->draws = stats.draws;
+					total->verts = stats.verts;
+				}
+				frame++;
+
+				window_update(window);
+
+				stats = (FrameStats) {0};
+				start = glfwGetTime();
+				GLCall(glBeginQuery(GL_TIME_ELAPSED, query));
+			} break;
+
+			default: break;
+		}
+	}
+
+	GLCall(glEndQuery(GL_TIME_ELAPSED));
+	GLCall(glDeleteQueries(1, &query));
+}
+
+void replay_report(Replay* replay, u32 loops) {
+	f64 cpu_total = 0, gpu_total = 0;
+	f64 cpu_max = 0, gpu_max = 0;
+
+	printf("frame\tcpu(ms)\tgpu(ms)\tdraws\tverts\n");
+	for (u32 i = 0; i < replay->frames_cnt; i++) {
+		FrameStats* s = &replay->frames[i];
+		f64 cpu = s->cpu_ms / loops;
+		f64 gpu = s->gpu_ms / loops;
+		printf("%d\t%.3f\t%.3f\t%d\t%d\n", i, cpu, gpu, s->draws, s->verts);
+
+		cpu_total += cpu;
+		gpu_total += gpu;
+		if (cpu > cpu_max) cpu_max = cpu;
+		if (gpu > gpu_max) gpu_max = gpu;
+	}
+
+	if (!replay->frames_cnt) return;
+	log_info(
+		"%d frames x %d loops: cpu avg %.3f ms max %.3f ms | gpu avg %.3f ms max %.3f ms\n",
+		replay->frames_cnt, loops,
+		cpu_total / replay->frames_cnt, cpu_max,
+		gpu_total / replay->frames_cnt, gpu_max
+	);
+}
+
+// :main
+int main(int argc, char** argv) {
+	// :args
+	const char* path = NULL;
+	u32 loops = 1;
+	for (i32 i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--loops") && i + 1 < argc) {
+			loops = atoi(argv[++i]);
+		} else {
+			path = argv[i];
+		}
+	}
+	panic(path, "usage: %s <file> [--loops N]", argv[0]);
+	if (loops == 0) loops = 1;
+
+	FILE* file = fopen(path, "rb");
+	panic(file, "Failed to open capture: %s\n", path);
+
+	IMR_Capture_Header header;
+	panic(fread(&header, sizeof(header), 1, file) == 1, "Capture is empty\n");
+	panic(header.magic == IMR_CAPTURE_MAGIC, "Not an imr capture: %s\n", path);
+	panic(header.version == IMR_CAPTURE_VERSION, "Unsupported capture version: %d\n", header.version);
+
+	Window window = window_new("IMR Replay", header.width, header.height);
+	glfwSwapInterval(0);
+
+	// Reading the whole stream upfront so that file io is not part of the timings
+	Replay replay = {0};
+	fseek(file, 0, SEEK_END);
+	replay.size = ftell(file) - sizeof(header);
+	fseek(file, sizeof(header), SEEK_SET);
+	replay.data = mem_alloc(replay.size);
+	panic(fread(replay.data, 1, replay.size, file) == replay.size, "Failed to read capture\n");
+	fclose(file);
+
+	// Counting frames
+	size_t offset = 0;
+	IMR_Capture_Record* record;
+	while ((record = replay_next_record(&replay, &offset))) {
+		if (record->type == IMR_CMD_FRAME) replay.frames_cnt++;
+	}
+	if (replay.frames_cnt > MAX_REPLAY_FRAMES) replay.frames_cnt = MAX_REPLAY_FRAMES;
+	replay.frames = mem_alloc(sizeof(FrameStats) * (replay.frames_cnt + 1));
+
+	IMR imr = imr_new(IMR_CONFIG_DEFAULT);
+	replay_load_textures(&replay);
+
+	for (u32 i = 0; i < loops && !window.should_close; i++)
+		replay_run(&replay, &imr, &window);
+
+	replay_report(&replay, loops);
+
+	// :clean
+	for (u32 i = 0; i < replay.targets_cnt; i++)
+		fbo_delete(&replay.targets[i].fbo);
+	for (u32 i = 0; i < replay.textures_cnt; i++) {
+		// Fbo textures are deleted along with their fbo
+		b32 owned = false;
+		for (u32 j = 0; j < replay.targets_cnt; j++)
+			owned |= replay.targets[j].fbo.color_texture.id == replay.textures[i].texture.id;
+		if (!owned) texture_delete(replay.textures[i].texture);
+	}
+	mem_free(replay.frames);
+	mem_free(replay.data);
+
+	imr_delete(&imr);
+	window_delete(window);
+	return 0;
+}